@@ -0,0 +1,557 @@
+#include "CAN.h"
+#include "Bytecode.h"
+#include "CodeEmitter.h"
+#include "GraphBuilder.h"
+#include "IR.h"
+#include "Jit.h"
+#include "Jobs.h"
+#include "Optimize.h"
+#include "PerfCounters.h"
+#include "PoolAllocator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <streambuf>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                    Benchmark
+///////////////////////////////////////////////////////////////////////////////
+// Builds synthetic graphs of a few shapes and times every stage between
+// building one and running it, each stage on its own.  Results come out as
+// JSON on stdout (or in the file named by --out) so they can be diffed
+// between releases.
+//
+//   Benchmark [--reps N] [--scale N] [--out file.json]
+//
+// Every repetition builds the graph from scratch since Forestify ruins it.
+// Times are the median over the repetitions, in milliseconds.  Printers write
+// into a null stream while being timed so the terminal isn't what gets
+// measured.
+//
+// Leaves are a mix of literals and inputs, so the optimizers can't fold a
+// whole graph down to a constant and leave the backends nothing to run.  A
+// case that fails to build or lower gets an "error" instead of timings and
+// the exit code is 1.
+//
+// Where perf_event_open works, forest execution also gets hardware counters,
+// averaged per run, under forest_execute_counters.
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                   Generators
+  ///////////////////////////////////////////////////////////////////////////////
+
+  // Input n is always fed n + 1
+  const int InputCount = 8;
+
+  IntegerLiteralNode* Literal(RuntimeManager& runtime, int value)
+  {
+    return runtime.AllocateAndGetWeakRef<IntegerLiteralNode>(value);
+  }
+
+  IntegerInputNode* Input(RuntimeManager& runtime, int index)
+  {
+    IntegerInputNode* input = runtime.AllocateAndGetWeakRef<IntegerInputNode>(index);
+    input->mValue = index + 1;
+    return input;
+  }
+
+  // Every other leaf is an input
+  Slot* Leaf(RuntimeManager& runtime, size_t i)
+  {
+    if (i % 2)
+    {
+      return &Literal(runtime, int(i))->mOut;
+    }
+
+    return &Input(runtime, int(i / 2 % InputCount))->mOut;
+  }
+
+  IntegerAdditionNode* Add(RuntimeManager& runtime, Slot* a, Slot* b)
+  {
+    IntegerAdditionNode* add = runtime.AllocateAndGetWeakRef<IntegerAdditionNode>();
+    add->mA.Connect(a);
+    add->mB.Connect(b);
+    return add;
+  }
+
+  void Print(RuntimeManager& runtime, NodeGraph& graph, Slot* in)
+  {
+    NodeHandle handle;
+    IntegerPrinterNode* printer = runtime.AllocateAndGetWeakRefWithHandle<IntegerPrinterNode>(handle);
+    printer->mIn.Connect(in);
+    graph.mFinals.push_back(handle);
+  }
+
+  // (((leaf + leaf) + leaf) + leaf) ..., size additions deep
+  void MakeChain(RuntimeManager& runtime, NodeGraph& graph, size_t size)
+  {
+    Slot* prev = Leaf(runtime, 0);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+      prev = &Add(runtime, prev, Leaf(runtime, i + 1))->mOut;
+    }
+
+    Print(runtime, graph, prev);
+  }
+
+  // Balanced tree of additions over size leaves
+  void MakeFanIn(RuntimeManager& runtime, NodeGraph& graph, size_t size)
+  {
+    std::vector<Slot*> level;
+    for (size_t i = 0; i < size; ++i)
+    {
+      level.push_back(Leaf(runtime, i));
+    }
+
+    while (level.size() > 1)
+    {
+      std::vector<Slot*> next;
+      for (size_t i = 0; i + 1 < level.size(); i += 2)
+      {
+        next.push_back(&Add(runtime, level[i], level[i + 1])->mOut);
+      }
+
+      if (level.size() % 2)
+      {
+        next.push_back(level.back());
+      }
+
+      level.swap(next);
+    }
+
+    Print(runtime, graph, level[0]);
+  }
+
+  // Layers of width additions where node i reads nodes i and i + 1 of the layer
+  // before, so every output feeds two nodes and every pair of layers is full of
+  // diamonds.  The first layer all reads one input.  Every node in the last
+  // layer is printed.
+  void MakeDiamonds(RuntimeManager& runtime, NodeGraph& graph, size_t width, size_t depth)
+  {
+    Slot* hub = &Input(runtime, 0)->mOut;
+
+    std::vector<Slot*> layer;
+    for (size_t i = 0; i < width; ++i)
+    {
+      layer.push_back(&Add(runtime, hub, hub)->mOut);
+    }
+
+    for (size_t d = 1; d < depth; ++d)
+    {
+      std::vector<Slot*> next;
+      for (size_t i = 0; i < width; ++i)
+      {
+        next.push_back(&Add(runtime, layer[i], layer[(i + 1) % width])->mOut);
+      }
+
+      layer.swap(next);
+    }
+
+    for (Slot* out : layer)
+    {
+      Print(runtime, graph, out);
+    }
+  }
+
+  // size unrelated (input + i) printers
+  void MakeRoots(RuntimeManager& runtime, NodeGraph& graph, size_t size)
+  {
+    for (size_t i = 0; i < size; ++i)
+    {
+      Print(runtime, graph, &Add(runtime, &Input(runtime, int(i % InputCount))->mOut, &Literal(runtime, int(i))->mOut)->mOut);
+    }
+  }
+
+  // Flattens what the generator built into GraphBuilder records so the same
+  // graph can be rebuilt in bulk.  Literals and inputs are the only stdlib
+  // nodes with Populate args that matter here, values keeps them alive.
+  void RecordGraph(RuntimeManager& runtime, const std::vector<NodeHandle>& order, std::vector<GraphBuilder::NodeRecord>& nodes, std::vector<GraphBuilder::EdgeRecord>& edges, std::vector<int>& values, std::vector<void*>& args)
+  {
+    std::vector<uint32_t> indices(runtime.GetHandleTable().GetCapacity());
+
+    values.resize(order.size());
+    args.resize(order.size());
+
+    for (uint32_t i = 0; i < order.size(); ++i)
+    {
+      Node* node = runtime.GetWeakRef(order[i]);
+      indices[order[i].mIndex] = i;
+
+      GraphBuilder::NodeRecord record = { node->GetTypeGUID(), nullptr };
+      if (node->GetTypeGUID() == IntegerLiteralNode::TypeGUID)
+      {
+        values[i] = static_cast<IntegerLiteralNode*>(node)->mOut.mValue;
+        args[i] = &values[i];
+        record.mArgs = &args[i];
+      }
+      else if (node->GetTypeGUID() == IntegerInputNode::TypeGUID)
+      {
+        values[i] = static_cast<IntegerInputNode*>(node)->mIndex;
+        args[i] = &values[i];
+        record.mArgs = &args[i];
+      }
+
+      nodes.push_back(record);
+
+      SlotRange inputs = node->GetInputSlots();
+      for (uint32_t slot = 0; slot < inputs.size(); ++slot)
+      {
+        for (Slot* output : inputs[slot]->mConnectedTo)
+        {
+          Node* from = output->GetParent();
+          SlotRange outputs = from->GetOutputSlots();
+
+          uint32_t outSlot = 0;
+          while (outputs[outSlot] != output)
+          {
+            ++outSlot;
+          }
+
+          edges.push_back({ i, slot, indices[from->GetHandle().mIndex], outSlot });
+        }
+      }
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                       Timing
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class NullBuffer : public std::streambuf
+  {
+  protected:
+    int overflow(int c) override { return c; }
+  };
+
+  template<typename F>
+  double TimeMs(F&& f)
+  {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::milli>(end - start).count();
+  }
+
+  double Median(std::vector<double> samples)
+  {
+    std::sort(samples.begin(), samples.end());
+    size_t middle = samples.size() / 2;
+
+    return samples.size() % 2 ? samples[middle] : (samples[middle - 1] + samples[middle]) / 2;
+  }
+
+  enum Stage
+  {
+    Build,
+    BulkBuild,
+    ForestifyStage,
+    GraphExecute,
+    IRLower,
+    IROptimize,
+    IRExecute,
+    ForestExecute,
+    SchedulerExecute,
+    ForestOptimize,
+    OptimizedForestExecute,
+    BytecodeCompile,
+    BytecodeExecute,
+    JitCompile,
+    JitExecute,
+    ToCPPStage,
+    StageCount
+  };
+
+  const char* StageNames[StageCount] =
+  {
+    "build_ms",
+    "bulk_build_ms",
+    "forestify_ms",
+    "graph_execute_ms",
+    "ir_lower_ms",
+    "ir_optimize_ms",
+    "ir_execute_ms",
+    "forest_execute_ms",
+    "scheduler_execute_ms",
+    "forest_optimize_ms",
+    "optimized_forest_execute_ms",
+    "bytecode_compile_ms",
+    "bytecode_execute_ms",
+    "jit_compile_ms",
+    "jit_execute_ms",
+    "tocpp_ms"
+  };
+
+  struct Case
+  {
+    const char* mName;
+    std::string mParameters; // JSON members describing the shape
+    std::function<void(RuntimeManager&, NodeGraph&)> mGenerate;
+  };
+
+  struct Result
+  {
+    size_t mNodeCount = 0;
+    size_t mRootCount = 0;
+    size_t mPeakBytes = 0;
+    std::vector<double> mSamples[StageCount];
+    PerfSample mForestCounters;
+    std::string mError; // Set if the case failed, timings are meaningless then
+  };
+
+  bool RunOnce(const Case& c, JobSystem& jobs, PerfCounters& counters, Result& result)
+  {
+    // The graph through GraphBuilder first.  It's recorded from a throwaway
+    // copy and the records are kept until both builds are done, so each build
+    // starts from the same heap rather than the bulk one paying for fresh pages
+    // next to a live graph.
+    std::vector<GraphBuilder::NodeRecord> nodes;
+    std::vector<GraphBuilder::EdgeRecord> edges;
+    std::vector<int> values;
+    std::vector<void*> args;
+
+    {
+      RuntimeManager recordRuntime;
+      PoolAllocatorFactory recordFactory;
+      recordRuntime.RegisterAllocatorFactory(&recordFactory);
+      recordRuntime.RegisterStandardLibrary();
+
+      NodeGraph recorded(&recordRuntime);
+      c.mGenerate(recordRuntime, recorded);
+
+      std::vector<NodeHandle> order;
+      TopologicalOrder(&recordRuntime, recorded.mFinals, order);
+      RecordGraph(recordRuntime, order, nodes, edges, values, args);
+    }
+
+    {
+      RuntimeManager bulkRuntime;
+      PoolAllocatorFactory bulkFactory;
+      bulkRuntime.RegisterAllocatorFactory(&bulkFactory);
+      bulkRuntime.RegisterStandardLibrary();
+
+      GraphBuilder bulk(&bulkRuntime);
+      std::vector<NodeHandle> handles;
+      bool built = false;
+      result.mSamples[BulkBuild].push_back(TimeMs([&]() { built = bulk.Build(nodes, edges, handles, result.mError); }));
+
+      if (!built)
+      {
+        return false;
+      }
+    }
+
+    RuntimeManager runtime;
+    PoolAllocatorFactory factory;
+    runtime.RegisterAllocatorFactory(&factory);
+    runtime.RegisterStandardLibrary();
+
+    NodeGraph graph(&runtime);
+    result.mSamples[Build].push_back(TimeMs([&]() { c.mGenerate(runtime, graph); }));
+
+    std::vector<NodeHandle> order;
+    TopologicalOrder(&runtime, graph.mFinals, order);
+    result.mNodeCount = order.size();
+
+    // Before Forestify, which rewires the graph
+    result.mSamples[GraphExecute].push_back(TimeMs([&]() { graph.Execute(); }));
+
+    // Lowering leaves the graph alone so it can go before Forestify too
+    IRProgram ir;
+    IRBuilder builder(&runtime);
+    bool lowered = false;
+    result.mSamples[IRLower].push_back(TimeMs([&]() { lowered = builder.Lower(graph, ir, result.mError); }));
+
+    if (!lowered)
+    {
+      return false;
+    }
+
+    result.mSamples[IROptimize].push_back(TimeMs([&]() { OptimizeIR(ir); }));
+
+    int inputs[InputCount];
+    for (int i = 0; i < InputCount; ++i)
+    {
+      inputs[i] = i + 1;
+    }
+
+    IRInterpreter irInterpreter;
+    result.mSamples[IRExecute].push_back(TimeMs([&]() { irInterpreter.Execute(ir, inputs); }));
+
+    NodeForest forest(&runtime);
+    result.mSamples[ForestifyStage].push_back(TimeMs([&]() { forest = Forestify(graph); }));
+    result.mRootCount = forest.mRoots.size();
+
+    if (!forest.mError.empty())
+    {
+      result.mError = forest.mError;
+      return false;
+    }
+
+    // Counters go around the timing so starting and stopping them isn't timed
+    PerfSample counted;
+    counters.Start();
+    result.mSamples[ForestExecute].push_back(TimeMs([&]() { forest.Execute(); }));
+    counters.Stop(counted);
+    result.mForestCounters.Add(counted);
+
+    runtime.RegisterJobSystem(&jobs);
+    ForestScheduler scheduler(forest);
+    result.mSamples[SchedulerExecute].push_back(TimeMs([&]() { scheduler.Execute(); }));
+    runtime.RegisterJobSystem(nullptr);
+
+    result.mSamples[ForestOptimize].push_back(TimeMs([&]() { OptimizeForest(forest); }));
+    result.mSamples[OptimizedForestExecute].push_back(TimeMs([&]() { forest.Execute(); }));
+
+    BytecodeProgram program;
+    BytecodeCompiler compiler(&runtime);
+    result.mSamples[BytecodeCompile].push_back(TimeMs([&]() { compiler.Compile(ir, program); }));
+
+    BytecodeInterpreter interpreter;
+    result.mSamples[BytecodeExecute].push_back(TimeMs([&]() { interpreter.Execute(program, inputs); }));
+
+    JitProgram jitProgram;
+    JitCompiler jit;
+    result.mSamples[JitCompile].push_back(TimeMs([&]() { jit.Compile(program, jitProgram); }));
+    result.mSamples[JitExecute].push_back(TimeMs([&]() { jitProgram.Execute(inputs); }));
+
+    std::ostringstream cpp;
+    CodeEmitter emitter(&runtime, cpp);
+    result.mSamples[ToCPPStage].push_back(TimeMs([&]() { emitter.EmitIR(ir); }));
+
+    result.mPeakBytes = runtime.GetMemoryStats().mPeakLiveBytes;
+    return true;
+  }
+
+  void WriteJson(FILE* out, const std::vector<Case>& cases, const std::vector<Result>& results, unsigned reps, unsigned workers)
+  {
+    std::fprintf(out, "{\n  \"reps\": %u,\n  \"workers\": %u,\n  \"benchmarks\": [\n", reps, workers);
+
+    for (size_t i = 0; i < cases.size(); ++i)
+    {
+      const Result& r = results[i];
+
+      if (!r.mError.empty())
+      {
+        std::fprintf(out, "    {\"name\": \"%s\", %s, \"error\": \"%s\"}%s\n", cases[i].mName, cases[i].mParameters.c_str(), r.mError.c_str(), i + 1 < cases.size() ? "," : "");
+        continue;
+      }
+
+      std::fprintf(out, "    {\"name\": \"%s\", %s, \"nodes\": %zu, \"roots\": %zu, \"peak_node_bytes\": %zu", cases[i].mName, cases[i].mParameters.c_str(), r.mNodeCount, r.mRootCount, r.mPeakBytes);
+
+      for (int stage = 0; stage < StageCount; ++stage)
+      {
+        std::fprintf(out, ", \"%s\": %.4f", StageNames[stage], Median(r.mSamples[stage]));
+      }
+
+      if (r.mForestCounters.mValid)
+      {
+        std::fprintf(out, ", \"forest_execute_counters\": {");
+
+        const char* separator = "";
+        for (size_t counter = 0; counter < PerfCounterCount; ++counter)
+        {
+          if (r.mForestCounters.IsValid(PerfCounter(counter)))
+          {
+            std::fprintf(out, "%s\"%s\": %llu", separator, PerfCounters::GetName(PerfCounter(counter)), (unsigned long long)(r.mForestCounters.Get(PerfCounter(counter)) / r.mForestCounters.mRuns));
+            separator = ", ";
+          }
+        }
+
+        std::fprintf(out, "}");
+      }
+
+      std::fprintf(out, "}%s\n", i + 1 < cases.size() ? "," : "");
+    }
+
+    std::fprintf(out, "  ]\n}\n");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  unsigned reps = 5;
+  size_t scale = 1;
+  const char* outPath = nullptr;
+
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (!std::strcmp(argv[i], "--reps"))
+    {
+      reps = std::max(1, std::atoi(argv[i + 1]));
+    }
+    else if (!std::strcmp(argv[i], "--scale"))
+    {
+      scale = std::max(1, std::atoi(argv[i + 1]));
+    }
+    else if (!std::strcmp(argv[i], "--out"))
+    {
+      outPath = argv[i + 1];
+    }
+  }
+
+  // NodeGraph::Execute re-runs shared subtrees and recurses once per node, so
+  // the chain and diamond depths stay where the graph path can still finish
+  std::vector<Case> cases =
+  {
+    { "chain", "\"size\": " + std::to_string(2000 * scale), [scale](RuntimeManager& r, NodeGraph& g) { MakeChain(r, g, 2000 * scale); } },
+    { "fan_in", "\"size\": " + std::to_string(65536 * scale), [scale](RuntimeManager& r, NodeGraph& g) { MakeFanIn(r, g, 65536 * scale); } },
+    { "diamonds", "\"width\": " + std::to_string(64 * scale) + ", \"depth\": 12", [scale](RuntimeManager& r, NodeGraph& g) { MakeDiamonds(r, g, 64 * scale, 12); } },
+    { "roots", "\"size\": " + std::to_string(10000 * scale), [scale](RuntimeManager& r, NodeGraph& g) { MakeRoots(r, g, 10000 * scale); } },
+  };
+
+  ThreadPool jobs;
+  std::vector<Result> results(cases.size());
+
+  PerfCounters counters;
+  std::string counterError;
+  if (!counters.Open(counterError))
+  {
+    std::fprintf(stderr, "%s, timing only\n", counterError.c_str());
+  }
+
+  NullBuffer null;
+  std::streambuf* stdoutBuffer = std::cout.rdbuf(&null);
+
+  bool failed = false;
+
+  for (size_t i = 0; i < cases.size(); ++i)
+  {
+    for (unsigned rep = 0; rep < reps; ++rep)
+    {
+      if (!RunOnce(cases[i], jobs, counters, results[i]))
+      {
+        failed = true;
+        break;
+      }
+    }
+  }
+
+  std::cout.rdbuf(stdoutBuffer);
+
+  FILE* out = outPath ? std::fopen(outPath, "w") : stdout;
+  if (!out)
+  {
+    std::fprintf(stderr, "Couldn't open %s\n", outPath);
+    return 1;
+  }
+
+  WriteJson(out, cases, results, reps, jobs.GetWorkerCount());
+
+  if (out != stdout)
+  {
+    std::fclose(out);
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,273 @@
+﻿#include "Batch.h"
+#include "Jobs.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CAN_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define CAN_X86 0
+#endif
+
+#if CAN_X86 && !defined(_MSC_VER)
+#define CAN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define CAN_TARGET(isa)
+#endif
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                      Kernels
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  void AddScalar(int* dst, const int* a, const int* b, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+    {
+      dst[i] = a[i] + b[i];
+    }
+  }
+
+#if CAN_X86
+  CAN_TARGET("sse2") void AddSSE2(int* dst, const int* a, const int* b, size_t count)
+  {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+      __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_add_epi32(l, r));
+    }
+
+    AddScalar(dst + i, a + i, b + i, count - i);
+  }
+
+  CAN_TARGET("avx2") void AddAVX2(int* dst, const int* a, const int* b, size_t count)
+  {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+      __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+      __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_add_epi32(l, r));
+    }
+
+    AddScalar(dst + i, a + i, b + i, count - i);
+  }
+#endif
+}
+
+SimdLevel CAN::DetectSimdLevel()
+{
+#if CAN_X86 && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  int maxLeaf = info[0];
+
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+
+  // AVX2 also needs the OS to be saving the upper halves of the ymm registers
+  if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+  {
+    __cpuidex(info, 7, 0);
+    if (info[1] & (1 << 5))
+    {
+      return SimdLevel::AVX2;
+    }
+  }
+
+  return sse2 ? SimdLevel::SSE2 : SimdLevel::Scalar;
+#elif CAN_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return SimdLevel::AVX2;
+  }
+
+  return __builtin_cpu_supports("sse2") ? SimdLevel::SSE2 : SimdLevel::Scalar;
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                            Batch Interpreter
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  size_t PrintCount(const BytecodeProgram& program)
+  {
+    return std::count_if(program.mInstructions.begin(), program.mInstructions.end(), [](const Instruction& i) { return i.mOpCode == OpCode::Print; });
+  }
+}
+
+BatchInterpreter::BatchInterpreter() : BatchInterpreter(DetectSimdLevel()) {}
+
+BatchInterpreter::BatchInterpreter(SimdLevel level) : mSimdLevel(level), mAdd(AddScalar)
+{
+#if CAN_X86
+  switch (level)
+  {
+  case SimdLevel::AVX2:
+    mAdd = AddAVX2;
+    break;
+  case SimdLevel::SSE2:
+    mAdd = AddSSE2;
+    break;
+  case SimdLevel::Scalar:
+    break;
+  }
+#else
+  mSimdLevel = SimdLevel::Scalar;
+#endif
+}
+
+void BatchInterpreter::Execute(const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t first, size_t count)
+{
+  mColumns.resize(size_t(program.mRegisterCount) * ChunkSize);
+  mPrinted.resize(PrintCount(program) * ChunkSize);
+
+  std::string prints;
+  for (size_t chunk = 0; chunk < count; chunk += ChunkSize)
+  {
+    ExecuteChunk(program, inputs, outputs, first + chunk, std::min(ChunkSize, count - chunk), prints);
+
+    if (!prints.empty())
+    {
+      std::cout.write(prints.data(), prints.size()).flush();
+      prints.clear();
+    }
+  }
+}
+
+void BatchInterpreter::Execute(const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t first, size_t count, std::string& prints)
+{
+  mColumns.resize(size_t(program.mRegisterCount) * ChunkSize);
+  mPrinted.resize(PrintCount(program) * ChunkSize);
+
+  for (size_t chunk = 0; chunk < count; chunk += ChunkSize)
+  {
+    ExecuteChunk(program, inputs, outputs, first + chunk, std::min(ChunkSize, count - chunk), prints);
+  }
+}
+
+void BatchInterpreter::ExecuteChunk(const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t first, size_t count, std::string& prints)
+{
+  int* columns = mColumns.data();
+  auto column = [columns](Register r) { return columns + size_t(r) * ChunkSize; };
+
+  // Printed columns are copied out since a later instruction can reuse the
+  // register, then written lane by lane once the chunk is done
+  int* printed = mPrinted.data();
+  size_t printCount = 0;
+
+  for (const Instruction& i : program.mInstructions)
+  {
+    switch (i.mOpCode)
+    {
+    case OpCode::LoadConstant:
+      std::fill_n(column(i.mDst), count, i.mImmediate);
+      break;
+    case OpCode::LoadInput:
+      std::memcpy(column(i.mDst), inputs[i.mA] + first, count * sizeof(int));
+      break;
+    case OpCode::Add:
+      mAdd(column(i.mDst), column(i.mA), column(i.mB), count);
+      break;
+    case OpCode::Print:
+      std::memcpy(printed + printCount++ * ChunkSize, column(i.mA), count * sizeof(int));
+      break;
+    case OpCode::Output:
+      std::memcpy(outputs[i.mImmediate] + first, column(i.mA), count * sizeof(int));
+      break;
+    }
+  }
+
+  for (size_t lane = 0; lane < count && printCount; ++lane)
+  {
+    for (size_t p = 0; p < printCount; ++p)
+    {
+      prints += std::to_string(printed[p * ChunkSize + lane]);
+      prints += '\n';
+    }
+  }
+}
+
+SimdLevel BatchInterpreter::GetSimdLevel() const { return mSimdLevel; }
+
+void CAN::ExecuteBatchParallel(RuntimeManager* runtime, const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t count)
+{
+  JobSystem* jobs = runtime->GetJobSystem();
+
+  if (!jobs)
+  {
+    BatchInterpreter interpreter;
+    interpreter.Execute(program, inputs, outputs, 0, count);
+    return;
+  }
+
+  // Whole chunks per range so only the last range runs a partial chunk
+  size_t chunks = (count + BatchInterpreter::ChunkSize - 1) / BatchInterpreter::ChunkSize;
+  size_t workers = std::max(1u, jobs->GetWorkerCount());
+  size_t perRange = (chunks + workers - 1) / workers * BatchInterpreter::ChunkSize;
+
+  struct Run
+  {
+    std::vector<std::string> mPrints;
+
+    std::mutex mDoneMutex;
+    std::condition_variable mDone;
+    size_t mRemaining = 0;
+  };
+
+  std::shared_ptr<Run> run = std::make_shared<Run>();
+  run->mPrints.resize(perRange ? (count + perRange - 1) / perRange : 0);
+  run->mRemaining = run->mPrints.size();
+
+  for (size_t range = 0; range < run->mPrints.size(); ++range)
+  {
+    size_t first = range * perRange;
+    size_t rangeCount = std::min(perRange, count - first);
+
+    jobs->Submit([run, &program, inputs, outputs, range, first, rangeCount]()
+    {
+      BatchInterpreter interpreter;
+      interpreter.Execute(program, inputs, outputs, first, rangeCount, run->mPrints[range]);
+
+      std::lock_guard<std::mutex> lock(run->mDoneMutex);
+      if (--run->mRemaining == 0)
+      {
+        run->mDone.notify_all();
+      }
+    });
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(run->mDoneMutex);
+    run->mDone.wait(lock, [&run]() { return run->mRemaining == 0; });
+  }
+
+  for (const std::string& prints : run->mPrints)
+  {
+    std::cout.write(prints.data(), prints.size());
+  }
+
+  std::cout.flush();
+}
@@ -0,0 +1,77 @@
+﻿#pragma once
+
+#include "Bytecode.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                              Batch Execution
+  ///////////////////////////////////////////////////////////////////////////////
+  // Runs one BytecodeProgram over many instances at once.  Every register holds
+  // a column with one lane per instance, so each instruction turns into a loop
+  // over its column and arithmetic goes through whichever SIMD kernel the CPU
+  // supports.
+  //
+  // Instances are run ChunkSize lanes at a time so the columns stay in cache no
+  // matter how big the batch is.  Prints come out instance by instance, each
+  // instance's lines in program order the same as running it on its own, and
+  // are written once per chunk.  Results the host wants back go through Output
+  // instructions into columns it passes in.
+  //
+  // An interpreter only touches its own columns, so a batch can be split into
+  // instance ranges and each range run as a job with its own BatchInterpreter.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  enum class SimdLevel
+  {
+    Scalar,
+    SSE2,
+    AVX2
+  };
+
+  SimdLevel DetectSimdLevel();
+
+  class BatchInterpreter
+  {
+  public:
+    static constexpr size_t ChunkSize = 1024;
+
+    BatchInterpreter();
+    BatchInterpreter(SimdLevel level);
+
+    // inputs[i] is the column for program input i and outputs[i] the column
+    // for program output i, both indexed by instance.  Runs instances
+    // [first, first + count).
+    void Execute(const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t first, size_t count);
+
+    // Same but Prints are appended to prints instead of going to std::cout
+    void Execute(const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t first, size_t count, std::string& prints);
+
+    SimdLevel GetSimdLevel() const;
+
+  private:
+    using AddKernel = void(*)(int* dst, const int* a, const int* b, size_t count);
+
+    void ExecuteChunk(const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t first, size_t count, std::string& prints);
+
+    SimdLevel mSimdLevel;
+    AddKernel mAdd;
+
+    // Register r's column starts at r * ChunkSize
+    std::vector<int> mColumns;
+
+    // The chunk's nth Print's column starts at n * ChunkSize
+    std::vector<int> mPrinted;
+  };
+
+  // Splits [0, count) into a whole number of chunks per worker of the
+  // runtime's JobSystem and blocks until they have all run.  Prints are held
+  // back per range and written in instance order at the end, so the output
+  // matches a single BatchInterpreter.  Runs on the calling thread if the
+  // runtime has no JobSystem, don't call it from inside a job.
+  void ExecuteBatchParallel(RuntimeManager* runtime, const BytecodeProgram& program, const int* const* inputs, int* const* outputs, size_t count);
+}
@@ -0,0 +1,95 @@
+﻿#include "Bytecode.h"
+#include "Optimize.h"
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                     Compiler
+///////////////////////////////////////////////////////////////////////////////
+
+BytecodeCompiler::BytecodeCompiler(RuntimeManager* runtime) : mManager(runtime) {}
+
+bool BytecodeCompiler::Compile(const NodeForest& forest, BytecodeProgram& program)
+{
+  IRProgram ir;
+  IRBuilder builder(mManager);
+  std::string error;
+  if (!builder.Lower(forest, ir, error))
+  {
+    program = BytecodeProgram();
+    return false;
+  }
+
+  OptimizeIR(ir);
+  return Compile(ir, program);
+}
+
+bool BytecodeCompiler::Compile(const IRProgram& ir, BytecodeProgram& program)
+{
+  program = BytecodeProgram();
+  program.mRegisterCount = Register(ir.mInstructions.size());
+  program.mInputCount = ir.mInputCount;
+  program.mOutputCount = ir.mOutputCount;
+
+  for (size_t i = 0; i < ir.mInstructions.size(); ++i)
+  {
+    const IRInstruction& instruction = ir.mInstructions[i];
+    Register dst = Register(i);
+
+    switch (instruction.mOp)
+    {
+    case IROp::Constant:
+      program.mInstructions.push_back({ OpCode::LoadConstant, dst, 0, 0, instruction.mImmediate });
+      break;
+    case IROp::Input:
+      program.mInstructions.push_back({ OpCode::LoadInput, dst, Register(instruction.mImmediate), 0, 0 });
+      break;
+    case IROp::Add:
+      program.mInstructions.push_back({ OpCode::Add, dst, instruction.mOperands[0], instruction.mOperands[1], 0 });
+      break;
+    case IROp::Print:
+      program.mInstructions.push_back({ OpCode::Print, 0, instruction.mOperands[0], 0, 0 });
+      break;
+    case IROp::Output:
+      program.mInstructions.push_back({ OpCode::Output, 0, instruction.mOperands[0], 0, instruction.mImmediate });
+      break;
+    default:
+      program = BytecodeProgram();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                  Interpreter
+///////////////////////////////////////////////////////////////////////////////
+
+void BytecodeInterpreter::Execute(const BytecodeProgram& program, const int* inputs, int* outputs)
+{
+  mRegisters.resize(program.mRegisterCount);
+  int* r = mRegisters.data();
+
+  for (const Instruction& i : program.mInstructions)
+  {
+    switch (i.mOpCode)
+    {
+    case OpCode::LoadConstant:
+      r[i.mDst] = i.mImmediate;
+      break;
+    case OpCode::LoadInput:
+      r[i.mDst] = inputs[i.mA];
+      break;
+    case OpCode::Add:
+      r[i.mDst] = r[i.mA] + r[i.mB];
+      break;
+    case OpCode::Print:
+      std::cout << r[i.mA] << std::endl;
+      break;
+    case OpCode::Output:
+      outputs[i.mImmediate] = r[i.mA];
+      break;
+    }
+  }
+}
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include "CAN.h"
+#include "IR.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                 Instructions
+  ///////////////////////////////////////////////////////////////////////////////
+
+  using Register = uint32_t;
+
+  enum class OpCode : uint8_t
+  {
+    LoadConstant, // mDst = mImmediate
+    LoadInput,    // mDst = input mA
+    Add,          // mDst = mA + mB
+    Print,        // print mA
+    Output,       // host output mImmediate = mA
+  };
+
+  struct Instruction
+  {
+    OpCode mOpCode;
+    Register mDst;
+    Register mA;
+    Register mB;
+    int mImmediate;
+  };
+
+  // An IRProgram lowered into a flat instruction stream, instructions stay in
+  // the IR's order.
+  class BytecodeProgram
+  {
+  public:
+    std::vector<Instruction> mInstructions;
+    Register mRegisterCount = 0;
+    uint32_t mInputCount = 0;
+    uint32_t mOutputCount = 0;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                     Compiler
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class BytecodeCompiler
+  {
+  public:
+    BytecodeCompiler(RuntimeManager* runtime);
+
+    // Lowers the forest and runs OptimizeIR on it first.  Returns false if it
+    // doesn't lower, in which case program is left empty and the forest should
+    // be run through Execute.
+    bool Compile(const NodeForest& forest, BytecodeProgram& program);
+
+    // Register n holds value n.  Returns false if the program has an op with
+    // no bytecode form, program is left empty then.
+    bool Compile(const IRProgram& ir, BytecodeProgram& program);
+
+  private:
+    RuntimeManager* mManager;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                  Interpreter
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class BytecodeInterpreter
+  {
+  public:
+    // inputs needs program.mInputCount values and outputs program.mOutputCount
+    void Execute(const BytecodeProgram& program, const int* inputs = nullptr, int* outputs = nullptr);
+
+  private:
+    std::vector<int> mRegisters;
+  };
+}
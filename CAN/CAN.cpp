@@ -1,6 +1,11 @@
 ﻿#include "CAN.h"
+#include "CodeEmitter.h"
+#include "Optimize.h"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <memory>
+#include <sstream>
 
 using namespace CAN;
 
@@ -13,11 +18,131 @@ AllocatorFactory::AbsoluteBlockHandle Allocator::AbsoluteHandleFromRelativeHandl
   return { GetAllocatorHandle(), handle };
 }
 
+void Allocator::AllocateBulk(size_t count, AllocatorFactory::RelativeBlockHandle* handles)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    handles[i] = Allocate();
+  }
+}
+
+void Allocator::FreeBulk(size_t count, const AllocatorFactory::RelativeBlockHandle* handles)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    Free(handles[i]);
+  }
+}
+
+size_t Allocator::GetReservedBytes() { return 0; }
+
 void* AllocatorFactory::GetWeakRef(AbsoluteBlockHandle handle)
 {
   return LookupAllocator(handle.mAllocatorHandle)->GetWeakRef(handle.mRelativeBlockHandle);
 }
 
+NodeHandle HandleTable::Insert(void* ref, AllocatorFactory::AbsoluteBlockHandle block)
+{
+  uint32_t index;
+
+  if (mFreeList != EndOfFreeList)
+  {
+    index = mFreeList;
+    mFreeList = mNextFree[index];
+  }
+  else
+  {
+    index = static_cast<uint32_t>(mRefs.size());
+    mRefs.push_back(nullptr);
+    mGenerations.push_back(0);
+    mBlocks.push_back({});
+    mNextFree.push_back(EndOfFreeList);
+  }
+
+  mRefs[index] = ref;
+  mBlocks[index] = block;
+
+  return { index, mGenerations[index] };
+}
+
+void HandleTable::Insert(size_t count, void* const* refs, const AllocatorFactory::AbsoluteBlockHandle* blocks, NodeHandle* handles)
+{
+  size_t i = 0;
+
+  for (; i < count && mFreeList != EndOfFreeList; ++i)
+  {
+    handles[i] = Insert(refs[i], blocks[i]);
+  }
+
+  uint32_t index = static_cast<uint32_t>(mRefs.size());
+  size_t size = index + (count - i);
+
+  mRefs.insert(mRefs.end(), refs + i, refs + count);
+  mGenerations.resize(size, 0);
+  mBlocks.insert(mBlocks.end(), blocks + i, blocks + count);
+  mNextFree.resize(size, EndOfFreeList);
+
+  for (; i < count; ++i)
+  {
+    handles[i] = { index++, 0 };
+  }
+}
+
+void HandleTable::Remove(NodeHandle handle)
+{
+  assert(IsValid(handle) && "Stale NodeHandle");
+
+  mRefs[handle.mIndex] = nullptr;
+  ++mGenerations[handle.mIndex];
+
+  mNextFree[handle.mIndex] = mFreeList;
+  mFreeList = handle.mIndex;
+}
+
+void HandleTable::Relocate(NodeHandle handle, void* ref, AllocatorFactory::AbsoluteBlockHandle block)
+{
+  assert(IsValid(handle) && "Stale NodeHandle");
+
+  mRefs[handle.mIndex] = ref;
+  mBlocks[handle.mIndex] = block;
+}
+
+bool HandleTable::IsValid(NodeHandle handle) const
+{
+  return handle.mIndex < mRefs.size() && mGenerations[handle.mIndex] == handle.mGeneration;
+}
+
+AllocatorFactory::AbsoluteBlockHandle HandleTable::GetBlock(NodeHandle handle) const
+{
+  assert(IsValid(handle) && "Stale NodeHandle");
+  return mBlocks[handle.mIndex];
+}
+
+uint32_t HandleTable::GetCapacity() const { return static_cast<uint32_t>(mRefs.size()); }
+
+void HandleTable::Reserve(size_t count)
+{
+  size_t capacity = mRefs.size() + count;
+
+  mRefs.reserve(capacity);
+  mGenerations.reserve(capacity);
+  mBlocks.reserve(capacity);
+  mNextFree.reserve(capacity);
+}
+
+void HandleTable::GetLiveHandles(std::vector<NodeHandle>& handles) const
+{
+  handles.clear();
+
+  for (uint32_t index = 0; index < mRefs.size(); ++index)
+  {
+    if (mRefs[index])
+    {
+      handles.push_back({ index, mGenerations[index] });
+    }
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                          Language Structures
 ///////////////////////////////////////////////////////////////////////////////
@@ -26,102 +151,470 @@ void* AllocatorFactory::GetWeakRef(AbsoluteBlockHandle handle)
 
 
 
-AllocatorFactory::AbsoluteBlockHandle RuntimeManager::AllocateNode(NodeTypeGUID type, void** args)
+NodeHandle RuntimeManager::AllocateNode(NodeTypeGUID type, void** args)
 {
-  auto allocator = mFactory->LookupAllocator(mAllocators[type]);
-  
+  return AllocateNodeByIndex(GetTypeIndex(type), args);
+}
+
+NodeHandle RuntimeManager::AllocateNodeByIndex(NodeTypeIndex index, void** args)
+{
+  const NodeTypeInfo& info = GetTypeInfo(index);
+  Allocator* allocator = info.mAllocator;
+
   auto relativeBlock = allocator->Allocate();
   Node* n = static_cast<Node*>(allocator->GetWeakRef(relativeBlock));
 
-  mInPlaceConstructors[type](n);
+  info.mConstruct(n);
   n->mManager = this;
+  n->mSlotLayout = info.mSlotLayout;
 
-  auto block = allocator->AbsoluteHandleFromRelativeHandle(relativeBlock);
+  auto block = mHandles.Insert(n, allocator->AbsoluteHandleFromRelativeHandle(relativeBlock));
+  n->mHandle = block;
   n->Populate(args);
 
+  CountAllocations(index, 1);
   return block;
 }
 
+void RuntimeManager::AllocateNodesByIndex(NodeTypeIndex index, size_t count, void** const* args, NodeHandle* handles, Node** refs)
+{
+  const NodeTypeInfo& info = GetTypeInfo(index);
+  Allocator* allocator = info.mAllocator;
+
+  std::vector<AllocatorFactory::RelativeBlockHandle> relative(count);
+  allocator->AllocateBulk(count, relative.data());
+
+  // All of the handles in one insert rather than growing the tables a node at
+  // a time
+  std::vector<void*> nodes(count);
+  std::vector<AllocatorFactory::AbsoluteBlockHandle> blocks(count);
+  AllocatorFactory::AllocatorHandle owner = allocator->GetAllocatorHandle();
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    nodes[i] = allocator->GetWeakRef(relative[i]);
+    blocks[i] = { owner, relative[i] };
+  }
+
+  mHandles.Insert(count, nodes.data(), blocks.data(), handles);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    Node* n = static_cast<Node*>(nodes[i]);
+
+    info.mConstruct(n);
+    n->mManager = this;
+    n->mSlotLayout = info.mSlotLayout;
+    n->mHandle = handles[i];
+
+    if (args)
+    {
+      n->Populate(args[i]);
+    }
+
+    if (refs)
+    {
+      refs[i] = n;
+    }
+  }
+
+  CountAllocations(index, count);
+}
+
+void RuntimeManager::ReserveNodes(size_t count) { mHandles.Reserve(count); }
+
+void RuntimeManager::FreeNode(NodeHandle handle)
+{
+  AllocatorFactory::AbsoluteBlockHandle block = mHandles.GetBlock(handle);
+  Node* node = GetWeakRef(handle);
+
+  NodeTypeIndex index = node->mSlotLayout->mTypeIndex;
+
+  DestroyNode(node, GetTypeInfo(index));
+  mFactory->LookupAllocator(block.mAllocatorHandle)->Free(block.mRelativeBlockHandle);
+
+  mHandles.Remove(handle);
+  CountFrees(index, 1);
+}
+
+void RuntimeManager::FreeNodesByIndex(NodeTypeIndex index, size_t count, const NodeHandle* handles)
+{
+  const NodeTypeInfo& info = GetTypeInfo(index);
+
+  std::vector<AllocatorFactory::RelativeBlockHandle> blocks;
+  blocks.reserve(count);
+  size_t freed = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (!mHandles.IsValid(handles[i]))
+    {
+      continue;
+    }
+
+    AllocatorFactory::AbsoluteBlockHandle block = mHandles.GetBlock(handles[i]);
+    Node* node = GetWeakRef(handles[i]);
+    assert(node->GetTypeGUID() == info.mTypeGUID && "Node freed as the wrong type");
+
+    DestroyNode(node, info);
+
+    // A relocated node might not live in its type's allocator anymore
+    if (block.mAllocatorHandle == info.mAllocatorHandle)
+    {
+      blocks.push_back(block.mRelativeBlockHandle);
+    }
+    else
+    {
+      mFactory->LookupAllocator(block.mAllocatorHandle)->Free(block.mRelativeBlockHandle);
+    }
+
+    mHandles.Remove(handles[i]);
+    ++freed;
+  }
+
+  info.mAllocator->FreeBulk(blocks.size(), blocks.data());
+  CountFrees(index, freed);
+}
+
+// Slots have no destructor, their connection storage is given back here
+void RuntimeManager::DestroyNode(Node* node, const NodeTypeInfo& info)
+{
+  for (Slot* input : node->GetInputSlots())
+  {
+    input->mConnectedTo.Free();
+  }
+
+  for (Slot* output : node->GetOutputSlots())
+  {
+    output->mConnectedTo.Free();
+  }
+
+  if (info.mDestruct)
+  {
+    info.mDestruct(node);
+  }
+}
+
+void RuntimeManager::RelocateNode(NodeHandle handle, AllocatorFactory::AbsoluteBlockHandle block)
+{
+  mHandles.Relocate(handle, mFactory->GetWeakRef(block), block);
+}
+
+const HandleTable& RuntimeManager::GetHandleTable() const { return mHandles; }
+
 void RuntimeManager::RegisterAllocatorFactory(AllocatorFactory* factory)
 {
   mFactory = factory;
 }
 
+void RuntimeManager::RegisterJobSystem(JobSystem* jobs)
+{
+  mJobSystem = jobs;
+}
+
+void RuntimeManager::RegisterProfiler(Profiler* profiler)
+{
+  mProfiler = profiler;
+}
+
 AllocatorFactory* RuntimeManager::GetAllocatorFactory() const { return mFactory; }
-Allocator* RuntimeManager::GetAllocator(NodeTypeGUID g) const { return mFactory->LookupAllocator(mAllocators.at(g)); }
+JobSystem* RuntimeManager::GetJobSystem() const { return mJobSystem; }
+Profiler* RuntimeManager::GetProfiler() const { return mProfiler; }
+Allocator* RuntimeManager::GetAllocator(NodeTypeGUID g) const { return GetTypeInfo(g).mAllocator; }
+
+NodeTypeIndex RuntimeManager::NextTypeIndex()
+{
+  static std::atomic<NodeTypeIndex> next(0);
+  return next++;
+}
+
+NodeTypeIndex RuntimeManager::GetTypeIndex(NodeTypeGUID g) const
+{
+  auto itr = mTypeIndices.find(g);
+  return itr == mTypeIndices.end() ? InvalidNodeTypeIndex : itr->second;
+}
 
 const std::vector<NodeTypeGUID>& RuntimeManager::GetNodeGUIDs() const { return mNodeGUIDs; }
-const std::string& RuntimeManager::GetNodeTypeName(NodeTypeGUID g) const { return mNodeTypeNames.at(g); }
-const std::vector<std::string>& RuntimeManager::GetOutputNames(NodeTypeGUID g) const { return mOutputNames.at(g); }
-const std::vector<SlotTypeGUID>& RuntimeManager::GetOutputTypes(NodeTypeGUID g) const { return mOutputTypes.at(g); }
-const std::vector<std::string>& RuntimeManager::GetInputNames(NodeTypeGUID g) const { return mInputNames.at(g); }
-const std::vector<SlotTypeGUID>& RuntimeManager::GetInputTypes(NodeTypeGUID g) const { return mInputTypes.at(g); }
+const std::string& RuntimeManager::GetNodeTypeName(NodeTypeGUID g) const { return GetTypeInfo(g).mName; }
+const std::vector<std::string>& RuntimeManager::GetOutputNames(NodeTypeGUID g) const { return GetTypeInfo(g).mOutputNames; }
+const std::vector<SlotTypeGUID>& RuntimeManager::GetOutputTypes(NodeTypeGUID g) const { return GetTypeInfo(g).mOutputTypes; }
+const std::vector<std::string>& RuntimeManager::GetInputNames(NodeTypeGUID g) const { return GetTypeInfo(g).mInputNames; }
+const std::vector<SlotTypeGUID>& RuntimeManager::GetInputTypes(NodeTypeGUID g) const { return GetTypeInfo(g).mInputTypes; }
+const SlotLayout& RuntimeManager::GetSlotLayout(NodeTypeGUID g) const { return *GetTypeInfo(g).mSlotLayout; }
+bool RuntimeManager::IsPure(NodeTypeGUID g) const { return GetTypeInfo(g).mPure; }
+
+RuntimeManager::~RuntimeManager()
+{
+  if (mLeakReport && mStats.mLiveNodes > 0)
+  {
+    WriteLeakReport(*mLeakReport);
+  }
+}
+
+const MemoryStats& RuntimeManager::GetMemoryStats() const { return mStats; }
+
+const MemoryStats& RuntimeManager::GetMemoryStats(NodeTypeGUID g) const
+{
+  NodeTypeIndex index = GetTypeIndex(g);
+  assert(index < mTypeStats.size() && "Node type not registered");
+  return mTypeStats[index];
+}
+
+size_t RuntimeManager::GetReservedBytes() const
+{
+  size_t bytes = 0;
+  for (const NodeTypeInfo& info : mTypes)
+  {
+    if (info.mAllocator)
+    {
+      bytes += info.mAllocator->GetReservedBytes();
+    }
+  }
+
+  return bytes;
+}
+
+void RuntimeManager::WriteLeakReport(std::ostream& out) const
+{
+  std::vector<NodeHandle> live;
+  mHandles.GetLiveHandles(live);
+
+  out << "CAN: " << live.size() << " node(s) still allocated, " << mStats.mLiveBytes << " bytes\n";
+
+  // Type from the block's allocator, the node itself might already be gone
+  std::unordered_map<AllocatorFactory::AllocatorHandle, const std::string*> names;
+  for (const NodeTypeInfo& info : mTypes)
+  {
+    if (info.mConstruct)
+    {
+      names[info.mAllocatorHandle] = &info.mName;
+    }
+  }
+
+  for (NodeHandle handle : live)
+  {
+    auto name = names.find(mHandles.GetBlock(handle).mAllocatorHandle);
+    out << "  " << (name != names.end() ? *name->second : "<relocated>") << " " << handle.mIndex << ":" << handle.mGeneration << "\n";
+  }
+}
+
+void RuntimeManager::SetLeakReport(std::ostream* out) { mLeakReport = out; }
 
 ///////////////////////////////////////////////////////////////////////////////
 //                                                             Graph Structures
 ///////////////////////////////////////////////////////////////////////////////
 
-Slot::Slot(Node* parent) : mParent(parent) {}
+Slot::Slot(Node* parent, SlotTypeGUID type)
+  : mTypeGUID(type), mParentOffset(static_cast<uint32_t>(reinterpret_cast<char*>(this) - reinterpret_cast<char*>(parent)))
+{
+}
+
+void ConnectionList::Free()
+{
+  if (mCapacity != 1)
+  {
+    delete[] mHeap;
+  }
+
+  mInline = nullptr;
+  mSize = 0;
+  mCapacity = 1;
+}
+
+Slot** ConnectionList::erase(Slot** first, Slot** last)
+{
+  Slot** newEnd = std::copy(last, end(), first);
+  mSize = static_cast<uint32_t>(newEnd - Data());
+  return first;
+}
+
+void ConnectionList::reserve(size_t capacity)
+{
+  if (capacity <= mCapacity)
+  {
+    return;
+  }
+
+  Slot** data = new Slot*[capacity];
+  std::copy(begin(), end(), data);
+
+  if (mCapacity != 1)
+  {
+    delete[] mHeap;
+  }
+
+  mHeap = data;
+  mCapacity = static_cast<uint32_t>(capacity);
+}
 
-bool Slot::CanConnect(Slot* other)
+bool Slot::CanConnect(Slot* other) const
 {
   return GetTypeGUID() == other->GetTypeGUID();
 }
 
 void Slot::Connect(Slot* other)
 {
-  SlotConnection connection;
-  connection.mInput = this;
-  connection.mOutput = other;
+  mConnectedTo.push_back(other);
+  other->mConnectedTo.push_back(this);
+}
 
-  mConnectedTo.push_back(connection);
-  other->mConnectedTo.push_back(connection);
+void Slot::Disconnect(Slot* other)
+{
+  mConnectedTo.erase(std::remove(mConnectedTo.begin(), mConnectedTo.end(), other), mConnectedTo.end());
+  other->mConnectedTo.erase(std::remove(other->mConnectedTo.begin(), other->mConnectedTo.end(), this), other->mConnectedTo.end());
 }
 
 std::vector<Slot*> Node::GetInputs() { return {}; }
 std::vector<Slot*> Node::GetOutputs() { return {}; }
 
 void Node::Execute() { printf("Base node executed.\n"); }
-std::string Node::ToCPP() { return "ERROR: Base Node Printed"; }
+bool Node::ToIR(IRBuilder&) { return false; }
+bool Node::FoldConstant(int&) { return false; }
+uint64_t Node::GetDataKey() { return 0; }
 
 RuntimeManager* Node::GetRuntime() { return mManager; }
+NodeHandle Node::GetHandle() const { return mHandle; }
 
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                Graph Helpers
 ///////////////////////////////////////////////////////////////////////////////
 
-NodeGraph::NodeGraph(RuntimeManager* manager) : mManager(manager) {}
+NodeArena::NodeArena(RuntimeManager* manager) : mManager(manager) {}
+
+NodeArena::~NodeArena()
+{
+  Release();
+}
+
+NodeHandle NodeArena::AllocateNode(NodeTypeGUID type, void** args)
+{
+  NodeTypeIndex index = mManager->GetTypeIndex(type);
+  NodeHandle handle = mManager->AllocateNodeByIndex(index, args);
+
+  Track(index, handle);
+  return handle;
+}
+
+void NodeArena::Adopt(NodeHandle handle)
+{
+  Track(mManager->GetTypeIndex(mManager->GetWeakRef(handle)->GetTypeGUID()), handle);
+}
+
+void NodeArena::Adopt(const std::vector<NodeHandle>& handles)
+{
+  for (NodeHandle handle : handles)
+  {
+    Adopt(handle);
+  }
+}
+
+void NodeArena::Release()
+{
+  for (NodeTypeIndex type = 0; type < mNodes.size(); ++type)
+  {
+    std::vector<NodeHandle>& nodes = mNodes[type];
+
+    if (!nodes.empty())
+    {
+      mManager->FreeNodesByIndex(type, nodes.size(), nodes.data());
+      nodes.clear();
+    }
+  }
+
+  mTrackedBytes = 0;
+}
+
+MemoryStats NodeArena::GetStats() const
+{
+  MemoryStats stats;
+  stats.mAllocations = mAllocations;
+  stats.mPeakLiveBytes = mPeakBytes;
+
+  const HandleTable& table = mManager->GetHandleTable();
+
+  for (NodeTypeIndex type = 0; type < mNodes.size(); ++type)
+  {
+    size_t live = 0;
+    for (NodeHandle handle : mNodes[type])
+    {
+      live += table.IsValid(handle);
+    }
+
+    if (live > 0)
+    {
+      stats.mLiveNodes += live;
+      stats.mLiveBytes += live * mManager->GetTypeInfo(type).mSize;
+    }
+  }
+
+  stats.mFrees = mAllocations - stats.mLiveNodes;
+  return stats;
+}
+
+RuntimeManager* NodeArena::GetRuntime() const { return mManager; }
+
+void NodeArena::Track(NodeTypeIndex type, NodeHandle handle)
+{
+  if (type >= mNodes.size())
+  {
+    mNodes.resize(type + 1);
+  }
+
+  mNodes[type].push_back(handle);
+
+  ++mAllocations;
+  mTrackedBytes += mManager->GetTypeInfo(type).mSize;
+  mPeakBytes = std::max(mPeakBytes, mTrackedBytes);
+}
+
+NodeGraph::NodeGraph(RuntimeManager* manager) : NodeGraph(std::make_shared<NodeArena>(manager)) {}
+
+NodeGraph::NodeGraph(std::shared_ptr<NodeArena> arena) : mArena(std::move(arena)), mManager(mArena->GetRuntime()) {}
 
 void NodeGraph::Execute()
 {
-  for (AllocatorFactory::AbsoluteBlockHandle node : mFinals)
+  for (NodeHandle node : mFinals)
   {
-    static_cast<Node*>(mManager->GetAllocatorFactory()->GetWeakRef(node))->Execute();
+    mManager->GetWeakRef(node)->Run();
   }
 }
 
 RuntimeManager* NodeGraph::GetRuntime() const { return mManager; }
 
-NodeForest::NodeForest(RuntimeManager* manager) : mManager(manager) {}
+NodeForest::NodeForest(RuntimeManager* manager) : NodeForest(std::make_shared<NodeArena>(manager)) {}
+
+NodeForest::NodeForest(std::shared_ptr<NodeArena> arena) : mArena(std::move(arena)), mManager(mArena->GetRuntime()) {}
 
 void NodeForest::Execute()
 {
-  for (AllocatorFactory::AbsoluteBlockHandle node : mRoots)
+  for (NodeHandle node : mRoots)
   {
-    static_cast<Node*>(mManager->GetAllocatorFactory()->GetWeakRef(node))->Execute();
+    mManager->GetWeakRef(node)->Run();
   }
 }
 
 std::string NodeForest::ToCPP()
 {
-  std::string acc = "{\n";
-  for (AllocatorFactory::AbsoluteBlockHandle node : mRoots)
+  std::ostringstream out;
+  ToCPP(out);
+  return out.str();
+}
+
+void NodeForest::ToCPP(std::ostream& out)
+{
+  IRProgram ir;
+  IRBuilder builder(mManager);
+  std::string error;
+  if (!builder.Lower(*this, ir, error))
   {
-    acc += static_cast<Node*>(mManager->GetAllocatorFactory()->GetWeakRef(node))->ToCPP() + ";\n";
+    out << "ERROR: " << error;
+    return;
   }
 
-  acc += "}\n";
-  return acc;
+  OptimizeIR(ir);
+
+  CodeEmitter emitter(mManager, out);
+  emitter.EmitIR(ir);
 }
 
 RuntimeManager* NodeForest::GetRuntime() const { return mManager; }
@@ -132,103 +625,312 @@ RuntimeManager* NodeForest::GetRuntime() const { return mManager; }
 
 void RuntimeManager::RegisterStandardLibrary()
 {
-  RegisterNodeType<IntegerLiteralNode>("IntegerLiteralNode", { "mOut" }, { IntegerSlot::TypeGUID }, {}, {});
-  RegisterNodeType<IntegerAdditionNode>("IntegerAdditionNode", { "mOut" }, { IntegerSlot::TypeGUID }, { "a", "b" }, { IntegerSlot::TypeGUID, IntegerSlot::TypeGUID });
+  RegisterNodeType<IntegerLiteralNode>("IntegerLiteralNode", { "mOut" }, { IntegerSlot::TypeGUID }, {}, {}, true);
+  RegisterNodeType<IntegerInputNode>("IntegerInputNode", { "mOut" }, { IntegerSlot::TypeGUID }, {}, {}, true);
+  RegisterNodeType<IntegerAdditionNode>("IntegerAdditionNode", { "mOut" }, { IntegerSlot::TypeGUID }, { "a", "b" }, { IntegerSlot::TypeGUID, IntegerSlot::TypeGUID }, true);
   RegisterNodeType<IntegerPrinterNode>("IntegerPrinterNode", {}, {}, { "mIn" }, { IntegerSlot::TypeGUID });
+  RegisterNodeType<IntegerOutputNode>("IntegerOutputNode", {}, {}, { "mIn" }, { IntegerSlot::TypeGUID });
 
   RegisterNodeType<StoreIntegerVariableNode>("StoreIntegerVariableNode", {}, {}, { "mIn" }, { IntegerSlot::TypeGUID });
   RegisterNodeType<LoadIntegerVariableNode>("LoadIntegerVariableNode", { "mOut" }, { IntegerSlot::TypeGUID }, {}, {});
 }
 
-std::string CAN::GenerateRandomVarName()
+NodeGraph CAN::NodeClusterToNodeGraph(RuntimeManager* runtime, std::vector<NodeHandle>& nodes)
 {
-  std::string str;
-  static char singleLetterName = 'a';
-  str.push_back(singleLetterName);
-  ++singleLetterName;
-  return str;
+  return NodeClusterToNodeGraph(std::make_shared<NodeArena>(runtime), nodes);
 }
 
-NodeGraph CAN::NodeClusterToNodeGraph(RuntimeManager* runtime, std::vector<AllocatorFactory::AbsoluteBlockHandle>& nodes)
+NodeGraph CAN::NodeClusterToNodeGraph(std::shared_ptr<NodeArena> arena, std::vector<NodeHandle>& nodes)
 {
-  NodeGraph graph(runtime);
+  RuntimeManager* runtime = arena->GetRuntime();
+  NodeGraph graph(std::move(arena));
 
   // Identify Roots
   for(auto& block : nodes)
   {
-    Node* node = static_cast<Node*>(runtime->GetAllocatorFactory()->GetWeakRef(block));
+    Node* node = runtime->GetWeakRef(block);
 
-    if(node->GetOutputs().empty())
+    if(node->GetOutputSlots().empty())
     {
       graph.mFinals.push_back(block);
     }
   }
 
+  // Nodes no final reaches stay allocated, OptimizeForest frees them when it's
+  // given this cluster
   return graph;
-  // @ErrorChecking(Jacob): Add some way to check for floating clusters
 }
 
-void CAN::RecursiveOutputCheck(Node* node, std::vector<AllocatorFactory::AbsoluteBlockHandle>& roots)
+namespace
 {
-  // For loop takes care of our base case, if the node doesn't have any inputs the for loop will never run 
-  // and the recursion will terminate
-  for(Slot* input : node->GetInputs())
+  enum class VisitState : uint8_t
   {
-    Slot* output = input->mConnectedTo[0].mOutput; // Should only be one connection per input
+    Unvisited,
+    InProgress,
+    Done
+  };
 
-    // If the output is connected to multiple inputs
-    if (output->mConnectedTo.size() > 1)
+  // Dense on NodeHandle::mIndex, grows on demand
+  class VisitedSet
+  {
+  public:
+    VisitState Get(NodeHandle handle) const
+    {
+      return handle.mIndex < mStates.size() ? mStates[handle.mIndex] : VisitState::Unvisited;
+    }
+
+    void Set(NodeHandle handle, VisitState state)
+    {
+      if (handle.mIndex >= mStates.size())
+      {
+        mStates.resize(handle.mIndex + 1, VisitState::Unvisited);
+      }
+
+      mStates[handle.mIndex] = state;
+    }
+
+  private:
+    std::vector<VisitState> mStates;
+  };
+
+  struct VisitFrame
+  {
+    Node* mNode;
+    SlotRange mInputs;
+    size_t mNextInput;
+  };
+
+  // Depth first over everything roots reach, finished(node) is called once per
+  // node after every node it reads from.  Stops and returns false on a cycle.
+  template<typename Finished>
+  bool PostOrder(RuntimeManager* runtime, const std::vector<NodeHandle>& roots, Finished&& finished)
+  {
+    VisitedSet visited;
+    std::vector<VisitFrame> stack;
+
+    for (NodeHandle root : roots)
+    {
+      if (visited.Get(root) != VisitState::Unvisited)
+      {
+        continue;
+      }
+
+      Node* rootNode = runtime->GetWeakRef(root);
+      stack.push_back({ rootNode, rootNode->GetInputSlots(), 0 });
+      visited.Set(root, VisitState::InProgress);
+
+      while (!stack.empty())
+      {
+        VisitFrame& frame = stack.back();
+
+        if (frame.mNextInput == frame.mInputs.size())
+        {
+          visited.Set(frame.mNode->GetHandle(), VisitState::Done);
+          finished(frame.mNode);
+
+          stack.pop_back();
+          continue;
+        }
+
+        Slot* input = frame.mInputs[frame.mNextInput++];
+        if (input->mConnectedTo.empty())
+        {
+          continue;
+        }
+
+        Node* producer = input->mConnectedTo[0]->GetParent();
+
+        VisitState state = visited.Get(producer->GetHandle());
+        if (state == VisitState::Unvisited)
+        {
+          visited.Set(producer->GetHandle(), VisitState::InProgress);
+          stack.push_back({ producer, producer->GetInputSlots(), 0 }); // frame is dangling after this
+        }
+        else if (state == VisitState::InProgress)
+        {
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  // Hooks up a Store to output and a Load to every input it used to feed
+  NodeHandle SplitSharedOutput(NodeArena* arena, Slot* output)
+  {
+    NodeHandle store;
+    StoreIntegerVariableNode* storeArea = arena->AllocateAndGetWeakRefWithHandle<StoreIntegerVariableNode>(store);
+
+    // Connect all inputs from the multi-output to a new load
+    for (Slot* reader : output->mConnectedTo)
     {
-      // Create a temporary and hook that up to the input instead
-      
-      AllocatorFactory::AbsoluteBlockHandle store;
-      StoreIntegerVariableNode* storeArea = node->GetRuntime()->AllocateAndGetWeakRefWithHandle<StoreIntegerVariableNode>(store);
+      LoadIntegerVariableNode* load = arena->AllocateAndGetWeakRef<LoadIntegerVariableNode>(store);
+
+      reader->mConnectedTo.clear();
+      reader->Connect(&load->mOut);
+    }
+
+    // Connect the output to the store
+    output->mConnectedTo.clear();
+    storeArea->mIn.Connect(output);
+
+    return store;
+  }
+}
+
+bool CAN::TopologicalOrder(RuntimeManager* runtime, const std::vector<NodeHandle>& roots, std::vector<NodeHandle>& order)
+{
+  order.clear();
+
+  if (!PostOrder(runtime, roots, [&order](Node* node) { order.push_back(node->GetHandle()); }))
+  {
+    order.clear();
+    return false;
+  }
+
+  return true;
+}
 
-      // Connect all inputs from the multi-output to a new load
-      for(SlotConnection& connection : output->mConnectedTo)
+bool EdgeTable::Build(RuntimeManager* runtime, const std::vector<NodeHandle>& roots)
+{
+  Clear();
+
+  mIds.assign(runtime->GetHandleTable().GetCapacity(), NoNode);
+  mInputStarts.push_back(0);
+  mOutputStarts.push_back(0);
+  mReaderStarts.push_back(0);
+
+  // A node is finished right after the nodes it reads from, so its producers
+  // already have ids and are likely still in cache
+  auto finished = [this](Node* node)
+  {
+    uint32_t id = GetNodeCount();
+
+    mOrder.push_back(node->GetHandle());
+    mNodes.push_back(node);
+    mIds[node->GetHandle().mIndex] = id;
+
+    SlotRange inputs = node->GetInputSlots();
+    for (Slot* input : inputs)
+    {
+      if (input->mConnectedTo.empty())
       {
-        LoadIntegerVariableNode* load = node->GetRuntime()->AllocateAndGetWeakRef<LoadIntegerVariableNode>(store);
+        mInputs.push_back({ NoNode, 0 });
+        continue;
+      }
 
-        connection.mInput->mConnectedTo.clear();
-        connection.mInput->Connect(&load->mOut);
+      Slot* output = input->mConnectedTo[0];
+      uint32_t producer = mIds[output->GetParent()->GetHandle().mIndex];
+
+      SlotRange outputs = mNodes[producer]->GetOutputSlots();
+      uint32_t slot = 0;
+      while (outputs[slot] != output)
+      {
+        ++slot;
       }
 
-      roots.push_back(store);
+      mInputs.push_back({ producer, slot });
+      ++mReaderStarts[GetOutputIndex(producer, slot) + 1];
+    }
+
+    size_t outputCount = node->GetOutputSlots().size();
+    mReaderStarts.resize(mReaderStarts.size() + outputCount, 0);
+
+    mInputStarts.push_back(mInputStarts.back() + static_cast<uint32_t>(inputs.size()));
+    mOutputStarts.push_back(mOutputStarts.back() + static_cast<uint32_t>(outputCount));
+  };
+
+  if (!PostOrder(runtime, roots, finished))
+  {
+    Clear();
+    return false;
+  }
+
+  uint32_t nodeCount = GetNodeCount();
+
+  for (size_t i = 1; i < mReaderStarts.size(); ++i)
+  {
+    mReaderStarts[i] += mReaderStarts[i - 1];
+  }
 
-      // Connect the output to the store
-      output->mConnectedTo.clear();
+  // Filled in id order so every reader list is sorted by reader
+  mReaders.resize(mReaderStarts.back());
+  std::vector<uint32_t> next(mReaderStarts.begin(), mReaderStarts.end() - 1);
 
-      storeArea->mIn.Connect(output);
+  for (uint32_t node = 0; node < nodeCount; ++node)
+  {
+    EdgeRange inputs = GetInputs(node);
+    for (uint32_t slot = 0; slot < inputs.size(); ++slot)
+    {
+      if (inputs[slot].mNode != NoNode)
+      {
+        mReaders[next[GetOutputIndex(inputs[slot].mNode, inputs[slot].mSlot)]++] = { node, slot };
+      }
     }
+  }
+
+  return true;
+}
+
+void EdgeTable::Clear()
+{
+  mOrder.clear();
+  mNodes.clear();
+  mIds.clear();
+  mInputStarts.clear();
+  mInputs.clear();
+  mOutputStarts.clear();
+  mReaderStarts.clear();
+  mReaders.clear();
+}
 
-    // Recurse
-    RecursiveOutputCheck(output->mParent, roots);
+uint32_t EdgeTable::GetId(NodeHandle handle) const
+{
+  if (handle.mIndex >= mIds.size())
+  {
+    return NoNode;
   }
+
+  uint32_t node = mIds[handle.mIndex];
+  return node != NoNode && mOrder[node] == handle ? node : NoNode;
 }
 
 // Will ruin graph FYI
 NodeForest CAN::Forestify(NodeGraph ng)
 {
-  NodeForest forest(ng.GetRuntime());
-  std::vector<AllocatorFactory::AbsoluteBlockHandle> addedNodes;
+  NodeForest forest(ng.mArena);
 
-  for(AllocatorFactory::AbsoluteBlockHandle final : ng.mFinals)
+  // Check for cycles before touching anything, splitting a shared output that's
+  // part of a cycle would hide it behind a Load that reads its own Store
+  std::vector<NodeHandle> order;
+  if (!TopologicalOrder(forest.GetRuntime(), ng.mFinals, order))
   {
-    Node* node = static_cast<Node*>(forest.GetRuntime()->GetAllocatorFactory()->GetWeakRef(final));
-
-    RecursiveOutputCheck(node, addedNodes);
+    forest.mError = "Forestify: graph contains a cycle";
+    return forest;
   }
 
-  for(auto itr = addedNodes.rbegin(); itr != addedNodes.rend(); ++itr)
+  // Producers come before their readers, so Stores come out in an order where
+  // each one runs after any Store its input reads from
+  for (NodeHandle handle : order)
   {
-    forest.mRoots.push_back(*itr);
+    for (Slot* output : forest.GetRuntime()->GetWeakRef(handle)->GetOutputSlots())
+    {
+      if (output->mConnectedTo.size() > 1)
+      {
+        forest.mRoots.push_back(SplitSharedOutput(forest.mArena.get(), output));
+      }
+    }
   }
 
-  for (AllocatorFactory::AbsoluteBlockHandle final : ng.mFinals)
+  for (NodeHandle final : ng.mFinals)
   {
     forest.mRoots.push_back(final);
   }
-  
+
+  forest.mEdges.Build(forest.GetRuntime(), forest.mRoots);
+  forest.mTopologicalOrder = forest.mEdges.GetOrder();
+
   return forest;
 }
 
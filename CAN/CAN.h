@@ -1,12 +1,23 @@
 ﻿#pragma once
 
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
 #include <iostream>
 
 #include <functional>
 
+// Build with CAN_PROFILE=1 to have Node::Run report to the runtime's Profiler.
+// At 0 Node::Run is just Execute.
+#ifndef CAN_PROFILE
+#define CAN_PROFILE 0
+#endif
+
 namespace CAN
 {
   ///////////////////////////////////////////////////////////////////////////////
@@ -46,6 +57,11 @@ namespace CAN
     {
       AllocatorHandle mAllocatorHandle;
       RelativeBlockHandle mRelativeBlockHandle;
+
+      bool operator==(const AbsoluteBlockHandle& other) const
+      {
+        return mAllocatorHandle == other.mAllocatorHandle && mRelativeBlockHandle == other.mRelativeBlockHandle;
+      }
     };
 
     virtual ~AllocatorFactory() = default;
@@ -66,6 +82,17 @@ namespace CAN
     virtual AllocatorFactory::RelativeBlockHandle Allocate() = 0;
     virtual void Free(AllocatorFactory::RelativeBlockHandle handle) = 0;
 
+    // count blocks at once into handles.  Calls Allocate count times unless
+    // the allocator knows how to hand out a run of blocks in one go.
+    virtual void AllocateBulk(size_t count, AllocatorFactory::RelativeBlockHandle* handles);
+
+    // Gives count blocks back at once, the other half of AllocateBulk
+    virtual void FreeBulk(size_t count, const AllocatorFactory::RelativeBlockHandle* handles);
+
+    // Bytes the allocator is holding on to, handed out or not.  0 if it doesn't
+    // keep track.
+    virtual size_t GetReservedBytes();
+
     virtual void* GetWeakRef(AllocatorFactory::RelativeBlockHandle handle) = 0;
 
     virtual AllocatorFactory::AllocatorHandle GetAllocatorHandle() = 0;
@@ -73,58 +100,338 @@ namespace CAN
     AllocatorFactory::AbsoluteBlockHandle AbsoluteHandleFromRelativeHandle(AllocatorFactory::RelativeBlockHandle handle);
   };
 
+  // What the rest of CAN refers to nodes by.  Index into the runtime's
+  // HandleTable plus the generation of that entry when the handle was made,
+  // so handles to freed nodes can be caught.
+  struct NodeHandle
+  {
+    uint32_t mIndex;
+    uint32_t mGeneration;
+
+    bool operator==(const NodeHandle& other) const { return mIndex == other.mIndex && mGeneration == other.mGeneration; }
+    bool operator!=(const NodeHandle& other) const { return !(*this == other); }
+  };
+
+  struct NodeHandleHasher
+  {
+    size_t operator()(const NodeHandle& handle) const { return std::hash<uint64_t>()(uint64_t(handle.mGeneration) << 32 | handle.mIndex); }
+  };
+
+  // Dense table from NodeHandle to where the node currently lives.  Resolving
+  // is a single load out of mRefs, the generation check only exists in debug.
+  // Since everything holds handles instead of block handles a node's storage
+  // can be moved by just updating its entry.
+  class HandleTable
+  {
+  public:
+    NodeHandle Insert(void* ref, AllocatorFactory::AbsoluteBlockHandle block);
+
+    // Insert for count refs at once, whatever doesn't fit in removed entries
+    // goes on the end of the tables in one step rather than a push each
+    void Insert(size_t count, void* const* refs, const AllocatorFactory::AbsoluteBlockHandle* blocks, NodeHandle* handles);
+    void Remove(NodeHandle handle);
+    void Relocate(NodeHandle handle, void* ref, AllocatorFactory::AbsoluteBlockHandle block);
+
+    void* Resolve(NodeHandle handle) const
+    {
+      assert(IsValid(handle) && "Stale NodeHandle");
+      return mRefs[handle.mIndex];
+    }
+
+    bool IsValid(NodeHandle handle) const;
+    AllocatorFactory::AbsoluteBlockHandle GetBlock(NodeHandle handle) const;
+
+    // One past the largest index handed out, for dense side tables
+    uint32_t GetCapacity() const;
+
+    // Room for count more handles without the tables growing.  Call it once
+    // for everything that's about to be inserted, reserving in pieces defeats
+    // the tables' geometric growth.
+    void Reserve(size_t count);
+
+    // Every handle that hasn't been removed, in index order
+    void GetLiveHandles(std::vector<NodeHandle>& handles) const;
+
+  private:
+    static constexpr uint32_t EndOfFreeList = ~0u;
+
+    // Hot, touched by every Resolve
+    std::vector<void*> mRefs;
+
+    // Cold
+    std::vector<uint32_t> mGenerations;
+    std::vector<AllocatorFactory::AbsoluteBlockHandle> mBlocks;
+    std::vector<uint32_t> mNextFree;
+    uint32_t mFreeList = EndOfFreeList;
+  };
+
   ///////////////////////////////////////////////////////////////////////////////
   //                                                          Language Structures
   ///////////////////////////////////////////////////////////////////////////////
 
   class Node;
+  class Slot;
+  class JobSystem;
+  class Profiler;
+
+  // Byte offsets of a node type's slots from the start of the Node, worked out
+  // once at registration so graph passes can walk slots without calling
+  // GetInputs/GetOutputs
+  struct SlotLayout
+  {
+    std::vector<uint32_t> mInputOffsets;
+    std::vector<uint32_t> mOutputOffsets;
+
+    // Every node points at its layout, so this gets from a node to its type
+    // without hashing the GUID
+    uint32_t mTypeIndex = ~0u;
+  };
+
+  // Non owning view over one node's inputs or outputs
+  class SlotRange
+  {
+  public:
+    class Iterator
+    {
+    public:
+      Iterator(char* base, const uint32_t* offset) : mBase(base), mOffset(offset) {}
+
+      Slot* operator*() const { return reinterpret_cast<Slot*>(mBase + *mOffset); }
+      Iterator& operator++() { ++mOffset; return *this; }
+      bool operator!=(const Iterator& other) const { return mOffset != other.mOffset; }
+
+    private:
+      char* mBase;
+      const uint32_t* mOffset;
+    };
+
+    SlotRange(Node* node, const std::vector<uint32_t>& offsets)
+      : mBase(reinterpret_cast<char*>(node)), mBegin(offsets.data()), mEnd(offsets.data() + offsets.size()) {}
+
+    Iterator begin() const { return Iterator(mBase, mBegin); }
+    Iterator end() const { return Iterator(mBase, mEnd); }
+
+    size_t size() const { return mEnd - mBegin; }
+    bool empty() const { return mBegin == mEnd; }
+    Slot* operator[](size_t i) const { return reinterpret_cast<Slot*>(mBase + mBegin[i]); }
+
+  private:
+    char* mBase;
+    const uint32_t* mBegin;
+    const uint32_t* mEnd;
+  };
+
+  // Index of a node type in RuntimeManager's type table.  Handed out once per
+  // C++ type for the whole process, so templated code never has to look it up.
+  using NodeTypeIndex = uint32_t;
+
+  static constexpr NodeTypeIndex InvalidNodeTypeIndex = ~NodeTypeIndex(0);
+
+  // Everything registration knows about a node type, one contiguous entry so
+  // allocating a node touches one cache line instead of several hash maps
+  struct NodeTypeInfo
+  {
+    // Hot, read by every allocation
+    void(*mConstruct)(Node* area) = nullptr;
+    void(*mDestruct)(Node* node) = nullptr; // nullptr if there's nothing to run
+    Allocator* mAllocator = nullptr;
+    const SlotLayout* mSlotLayout = nullptr;
+    NodeTypeGUID mTypeGUID = 0;
+    uint32_t mSize = 0;
+    uint32_t mAlignment = 0;
+    bool mPure = false;
+
+    // Cold, introspection for the editor and passes
+    AllocatorFactory::AllocatorHandle mAllocatorHandle = 0;
+    std::string mName;
+    std::vector<std::string> mOutputNames;
+    std::vector<SlotTypeGUID> mOutputTypes;
+    std::vector<std::string> mInputNames;
+    std::vector<SlotTypeGUID> mInputTypes;
+  };
+
+  // Running totals for node memory.  Bytes are node sizes, what the allocators
+  // hold on top of that is Allocator::GetReservedBytes.  Counts only go up,
+  // sample them every frame and diff for rates.
+  struct MemoryStats
+  {
+    uint64_t mAllocations = 0;
+    uint64_t mFrees = 0;
+    size_t mLiveNodes = 0;
+    size_t mLiveBytes = 0;
+    size_t mPeakLiveBytes = 0;
+  };
 
   class RuntimeManager
   {
   public:
+    RuntimeManager() = default;
+    ~RuntimeManager();
+
+    // pure: the node's outputs depend only on its type, GetDataKey and its
+    // inputs, and running it has no side effects.  Pure nodes can be merged by
+    // EliminateCommonSubexpressions.
+    template<typename T>
+    void RegisterNodeType(std::string str_name, std::vector<std::string> output_names, std::vector<SlotTypeGUID> output_types, std::vector<std::string> input_names, std::vector<SlotTypeGUID> input_types, bool pure = false)
+    {
+      NodeTypeIndex index = GetTypeIndex<T>();
+      if (index >= mTypes.size())
+      {
+        mTypes.resize(index + 1);
+        mTypeStats.resize(index + 1);
+      }
+
+      NodeTypeInfo& info = mTypes[index];
+
+      // Registering a type again overwrites its info in place.  The layout and
+      // allocator are kept, nodes already made point at them.
+      if (mTypeIndices.emplace(T::TypeGUID, index).second)
+      {
+        mNodeGUIDs.push_back(T::TypeGUID);
+
+        mSlotLayouts.push_back(MakeSlotLayout<T>());
+        mSlotLayouts.back().mTypeIndex = index;
+
+        info.mAllocatorHandle = mFactory->MakeAllocator(sizeof(T), T::TypeGUID);
+        info.mAllocator = mFactory->LookupAllocator(info.mAllocatorHandle);
+        info.mSlotLayout = &mSlotLayouts.back();
+      }
+
+      info.mConstruct = &ConstructInPlace<T>;
+      info.mDestruct = std::is_trivially_destructible<T>::value ? nullptr : &DestructInPlace<T>;
+      info.mTypeGUID = T::TypeGUID;
+      info.mSize = static_cast<uint32_t>(sizeof(T));
+      info.mAlignment = static_cast<uint32_t>(alignof(T));
+      info.mPure = pure;
+
+      info.mName = std::move(str_name);
+      info.mOutputNames = std::move(output_names);
+      info.mOutputTypes = std::move(output_types);
+      info.mInputNames = std::move(input_names);
+      info.mInputTypes = std::move(input_types);
+    }
+
+    // Same for every RuntimeManager, whether or not T is registered with it
     template<typename T>
-    void RegisterNodeType(std::string str_name, std::vector<std::string> output_names, std::vector<SlotTypeGUID> output_types, std::vector<std::string> input_names, std::vector<SlotTypeGUID> input_types)
+    static NodeTypeIndex GetTypeIndex()
     {
-      mAllocators[T::TypeGUID] = mFactory->MakeAllocator(sizeof(T), T::TypeGUID);
+      static const NodeTypeIndex index = NextTypeIndex();
+      return index;
+    }
 
-      mNodeGUIDs.push_back(T::TypeGUID);
-      mNodeTypeNames[T::TypeGUID] = str_name;
-      mOutputNames[T::TypeGUID] = output_names;
-      mOutputTypes[T::TypeGUID] = output_types;
-      mInputNames[T::TypeGUID] = input_names;
-      mInputTypes[T::TypeGUID] = input_types;
+    // The one hash lookup, InvalidNodeTypeIndex if g isn't registered
+    NodeTypeIndex GetTypeIndex(NodeTypeGUID g) const;
 
-      mInPlaceConstructors[T::TypeGUID] = [](Node* area) { new (area) T(); };
+    const NodeTypeInfo& GetTypeInfo(NodeTypeIndex index) const
+    {
+      assert(index < mTypes.size() && mTypes[index].mConstruct && "Node type not registered");
+      return mTypes[index];
+    }
+
+    const NodeTypeInfo& GetTypeInfo(NodeTypeGUID g) const { return GetTypeInfo(GetTypeIndex(g)); }
+
+    template<typename T>
+    static void ConstructInPlace(Node* area)
+    {
+      new (area) T();
+    }
+
+    template<typename T>
+    static void DestructInPlace(Node* node)
+    {
+      static_cast<T*>(node)->~T();
+    }
+
+    // Asks a throwaway instance where its slots are, the only time the virtual
+    // GetInputs/GetOutputs get called for a type
+    template<typename T>
+    static SlotLayout MakeSlotLayout()
+    {
+      T probe;
+      char* base = reinterpret_cast<char*>(static_cast<Node*>(&probe));
+
+      SlotLayout layout;
+      for (Slot* input : probe.GetInputs())
+      {
+        layout.mInputOffsets.push_back(static_cast<uint32_t>(reinterpret_cast<char*>(input) - base));
+      }
+
+      for (Slot* output : probe.GetOutputs())
+      {
+        layout.mOutputOffsets.push_back(static_cast<uint32_t>(reinterpret_cast<char*>(output) - base));
+      }
+
+      return layout;
     }
 
     template<typename NodeType, typename... Args>
-    NodeType* AllocateAndGetWeakRefWithHandle(AllocatorFactory::AbsoluteBlockHandle& handleLoc, Args&&... args)
+    NodeType* AllocateAndGetWeakRefWithHandle(NodeHandle& handleLoc, Args&&... args)
     {
-      Allocator* refAllocator = GetAllocator(NodeType::TypeGUID);
-      AllocatorFactory::RelativeBlockHandle relativeRefHandle = refAllocator->Allocate(); // @Leak
+      const NodeTypeInfo& info = GetTypeInfo(GetTypeIndex<NodeType>());
+      Allocator* refAllocator = info.mAllocator;
+      AllocatorFactory::RelativeBlockHandle relativeRefHandle = refAllocator->Allocate();
       NodeType* ref = static_cast<NodeType*>(refAllocator->GetWeakRef(relativeRefHandle));
 
       new (ref) NodeType(args...);
       ref->mManager = this;
+      ref->mSlotLayout = info.mSlotLayout;
 
-      handleLoc = refAllocator->AbsoluteHandleFromRelativeHandle(relativeRefHandle);
+      handleLoc = mHandles.Insert(ref, refAllocator->AbsoluteHandleFromRelativeHandle(relativeRefHandle));
+      ref->mHandle = handleLoc;
 
+      CountAllocations(GetTypeIndex<NodeType>(), 1);
       return ref;
     }
 
     template<typename NodeType, typename... Args>
     NodeType* AllocateAndGetWeakRef(Args&&... args)
     {
-      AllocatorFactory::AbsoluteBlockHandle garbage;
+      NodeHandle garbage;
       return AllocateAndGetWeakRefWithHandle<NodeType>(garbage, args...);
     }
 
-    AllocatorFactory::AbsoluteBlockHandle AllocateNode(NodeTypeGUID type, void** args);
+    NodeHandle AllocateNode(NodeTypeGUID type, void** args);
+
+    // For callers making many nodes of a type, resolve the GUID once with
+    // GetTypeIndex and skip the lookup after that
+    NodeHandle AllocateNodeByIndex(NodeTypeIndex index, void** args);
+
+    // count nodes of one type from a single Allocator::AllocateBulk.  args[i]
+    // goes to the i'th node's Populate, args can be nullptr if the type
+    // doesn't read any.  refs, if given, gets the nodes themselves so they don't
+    // have to be looked up again.  See GraphBuilder for whole graphs.
+    void AllocateNodesByIndex(NodeTypeIndex index, size_t count, void** const* args, NodeHandle* handles, Node** refs = nullptr);
+
+    // Room for count more nodes' handles, for callers that know up front how
+    // many they're about to make
+    void ReserveNodes(size_t count);
+
+    // Frees the node's slot connections, runs its destructor if its type has
+    // one and gives its block back to the allocator.  Nothing connected to it
+    // is disconnected.
+    void FreeNode(NodeHandle handle);
+
+    // FreeNode for count nodes of one type, their blocks go back in a single
+    // Allocator::FreeBulk.  Handles that are already stale are skipped.
+    void FreeNodesByIndex(NodeTypeIndex index, size_t count, const NodeHandle* handles);
+
+    // For when a node's storage has been moved (compaction, hot reload), every
+    // NodeHandle to it stays valid
+    void RelocateNode(NodeHandle handle, AllocatorFactory::AbsoluteBlockHandle block);
+
+    Node* GetWeakRef(NodeHandle handle) const { return static_cast<Node*>(mHandles.Resolve(handle)); }
+    const HandleTable& GetHandleTable() const;
 
     void RegisterAllocatorFactory(AllocatorFactory* factory);
+    void RegisterJobSystem(JobSystem* jobs);
     void RegisterStandardLibrary();
 
+    // Only used when built with CAN_PROFILE, nullptr to stop profiling
+    void RegisterProfiler(Profiler* profiler);
+
     AllocatorFactory* GetAllocatorFactory() const;
+    JobSystem* GetJobSystem() const;
+    Profiler* GetProfiler() const;
     Allocator* GetAllocator(NodeTypeGUID g) const;
 
     const std::vector<NodeTypeGUID>& GetNodeGUIDs() const;
@@ -133,20 +440,82 @@ namespace CAN
     const std::vector<SlotTypeGUID>& GetOutputTypes(NodeTypeGUID g) const;
     const std::vector<std::string>& GetInputNames(NodeTypeGUID g) const;
     const std::vector<SlotTypeGUID>& GetInputTypes(NodeTypeGUID g) const;
+    const SlotLayout& GetSlotLayout(NodeTypeGUID g) const;
+    bool IsPure(NodeTypeGUID g) const;
+
+    // Memory accounting, always on.  Keeping it up is a few adds per node made
+    // or freed.
+    const MemoryStats& GetMemoryStats() const;
+    const MemoryStats& GetMemoryStats(NodeTypeGUID g) const;
+
+    // Allocator::GetReservedBytes over every registered type
+    size_t GetReservedBytes() const;
+
+    // One line per node that hasn't been freed, with its type and handle.
+    // Doesn't touch the nodes themselves so it's fine after the allocators
+    // are gone.
+    void WriteLeakReport(std::ostream& out) const;
+
+    // Has the runtime write its leak report to out when it's destroyed, if
+    // anything is still allocated.  nullptr turns it off.
+    void SetLeakReport(std::ostream* out);
 
   private:
+    static NodeTypeIndex NextTypeIndex();
+
+    void DestroyNode(Node* node, const NodeTypeInfo& info);
+
+    void CountAllocations(NodeTypeIndex index, size_t count)
+    {
+      const size_t bytes = count * mTypes[index].mSize;
+
+      MemoryStats& type = mTypeStats[index];
+      type.mAllocations += count;
+      type.mLiveNodes += count;
+      type.mLiveBytes += bytes;
+      type.mPeakLiveBytes = type.mLiveBytes > type.mPeakLiveBytes ? type.mLiveBytes : type.mPeakLiveBytes;
+
+      mStats.mAllocations += count;
+      mStats.mLiveNodes += count;
+      mStats.mLiveBytes += bytes;
+      mStats.mPeakLiveBytes = mStats.mLiveBytes > mStats.mPeakLiveBytes ? mStats.mLiveBytes : mStats.mPeakLiveBytes;
+    }
+
+    void CountFrees(NodeTypeIndex index, size_t count)
+    {
+      const size_t bytes = count * mTypes[index].mSize;
+
+      MemoryStats& type = mTypeStats[index];
+      type.mFrees += count;
+      type.mLiveNodes -= count;
+      type.mLiveBytes -= bytes;
+
+      mStats.mFrees += count;
+      mStats.mLiveNodes -= count;
+      mStats.mLiveBytes -= bytes;
+    }
+
     // Runtime Data
     AllocatorFactory * mFactory = nullptr;
-    std::unordered_map<NodeTypeGUID, AllocatorFactory::AllocatorHandle> mAllocators;
+    JobSystem* mJobSystem = nullptr;
+    Profiler* mProfiler = nullptr;
+    HandleTable mHandles;
+
+    // Type table, indexed by NodeTypeIndex.  Types registered with another
+    // runtime but not this one leave empty entries behind.
+    std::vector<NodeTypeInfo> mTypes;
+    std::unordered_map<NodeTypeGUID, NodeTypeIndex> mTypeIndices;
+
+    // Nodes point at their layout, a deque so registering doesn't move them
+    std::deque<SlotLayout> mSlotLayouts;
+
+    // Accounting, mTypeStats is indexed like mTypes
+    MemoryStats mStats;
+    std::vector<MemoryStats> mTypeStats;
+    std::ostream* mLeakReport = nullptr;
 
     // Introspection Data
     std::vector<NodeTypeGUID> mNodeGUIDs;
-    std::unordered_map<NodeTypeGUID, std::string> mNodeTypeNames;
-    std::unordered_map<NodeTypeGUID, std::vector<std::string>> mOutputNames;
-    std::unordered_map<NodeTypeGUID, std::vector<SlotTypeGUID>> mOutputTypes;
-    std::unordered_map<NodeTypeGUID, std::vector<std::string>> mInputNames;
-    std::unordered_map<NodeTypeGUID, std::vector<SlotTypeGUID>> mInputTypes;
-    std::unordered_map<NodeTypeGUID, std::function<void(Node*)>> mInPlaceConstructors;
   };
 
   ///////////////////////////////////////////////////////////////////////////////
@@ -155,69 +524,309 @@ namespace CAN
 
   class Node;
   class Slot;
+  class IRBuilder;
 
-  class SlotConnection
+  // What a Slot keeps its connections in, the slots on the other end of each.
+  // Inputs only ever have one and most outputs feed one reader, so the first
+  // lives inline and only slots with more go to the heap.  Just the part of
+  // std::vector the passes use.
+  //
+  // No destructor so nodes made of slots stay trivially destructible, whoever
+  // frees a node calls Free on each of its slots instead.
+  class ConnectionList
   {
   public:
-    Slot * mOutput;
-    Slot* mInput;
+    ConnectionList() = default;
+    ConnectionList(const ConnectionList& other) = delete;
+    ConnectionList& operator=(const ConnectionList& other) = delete;
+
+    Slot** begin() { return Data(); }
+    Slot** end() { return Data() + mSize; }
+    Slot* const* begin() const { return Data(); }
+    Slot* const* end() const { return Data() + mSize; }
+
+    size_t size() const { return mSize; }
+    size_t capacity() const { return mCapacity; }
+    bool empty() const { return mSize == 0; }
+
+    Slot* operator[](size_t i) const { return Data()[i]; }
+    Slot* back() const { return Data()[mSize - 1]; }
+
+    void push_back(Slot* slot)
+    {
+      if (mSize == mCapacity)
+      {
+        reserve(size_t(mCapacity) * 2);
+      }
+
+      Data()[mSize++] = slot;
+    }
+
+    void clear() { mSize = 0; }
+    Slot** erase(Slot** first, Slot** last);
+    void reserve(size_t capacity);
+
+    // Empties the list and gives back any heap storage
+    void Free();
+
+  private:
+    Slot** Data() { return mCapacity == 1 ? &mInline : mHeap; }
+    Slot* const* Data() const { return mCapacity == 1 ? &mInline : mHeap; }
+
+    union
+    {
+      Slot* mInline = nullptr;
+      Slot** mHeap;
+    };
+
+    uint32_t mSize = 0;
+    uint32_t mCapacity = 1;
   };
 
 #define SlotMixin(TYPE) \
-static const CAN::SlotTypeGUID TypeGUID = Hash(#TYPE); \
-CAN::SlotTypeGUID GetTypeGUID() override { return TypeGUID; }
+static const CAN::SlotTypeGUID TypeGUID = Hash(#TYPE);
 
+  // Plain data, no vtable.  The type is a tag the derived slot passes up and
+  // the parent is found from the slot's offset inside it, which also means a
+  // node's storage can be moved without fixing its slots up.
   class Slot
   {
   public:
-    Slot(Node* parent);
-    virtual ~Slot() = default;
+    Slot(Node* parent, SlotTypeGUID type);
 
-    virtual bool CanConnect(Slot* other);
+    bool CanConnect(Slot* other) const;
     void Connect(Slot* other);
+    void Disconnect(Slot* other);
 
-    virtual SlotTypeGUID GetTypeGUID() = 0;
+    SlotTypeGUID GetTypeGUID() const { return mTypeGUID; }
+    Node* GetParent() const { return reinterpret_cast<Node*>(reinterpret_cast<uintptr_t>(this) - mParentOffset); }
 
-    Node* mParent;
-    std::vector<SlotConnection> mConnectedTo;
+    // Outputs for an input, inputs for an output
+    ConnectionList mConnectedTo;
+
+  private:
+    SlotTypeGUID mTypeGUID;
+    uint32_t mParentOffset;
   };
 
 #define NodeMixin(TYPE) \
 static const CAN::NodeTypeGUID TypeGUID = Hash(#TYPE); \
 CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
 
+  // Nodes are only ever destroyed through their type's NodeTypeInfo, so the
+  // destructor isn't virtual and node types without one of their own cost
+  // nothing to free.
   class Node
   {
   public:
-    virtual ~Node() = default;
+    // Only used to build the type's SlotLayout at registration, everything else
+    // should go through GetInputSlots/GetOutputSlots
     virtual std::vector<Slot*> GetInputs();
     virtual std::vector<Slot*> GetOutputs();
 
+    SlotRange GetInputSlots() { return SlotRange(this, mSlotLayout->mInputOffsets); }
+    SlotRange GetOutputSlots() { return SlotRange(this, mSlotLayout->mOutputOffsets); }
+
     virtual void Populate(void** args) {}
 
     virtual void Execute();
-    virtual std::string ToCPP();
+
+    // What anything running a node should call instead of Execute, including
+    // nodes running their inputs, so the profiler sees every call
+#if CAN_PROFILE
+    void Run();
+#else
+    void Run() { Execute(); }
+#endif
+
+    // Lowers the node into builder's program, inputs are guaranteed to already
+    // be lowered.  Returns false if the node has no IR form.
+    virtual bool ToIR(IRBuilder& builder);
+
+    // The value this node always produces if that can be worked out without
+    // running it.  Only the direct inputs get looked at, the optimizer folds
+    // inputs first so whole literal subtrees still collapse.
+    virtual bool FoldConstant(int& value);
+
+    // Everything Populate put into the node that its outputs depend on, packed
+    // into one key.  Two pure nodes of the same type with the same key and the
+    // same inputs are the same value.
+    virtual uint64_t GetDataKey();
 
     virtual NodeTypeGUID GetTypeGUID() = 0;
 
     RuntimeManager* GetRuntime();
+    NodeHandle GetHandle() const;
+
+  protected:
+    ~Node() = default;
 
   private:
     RuntimeManager * mManager;
+    NodeHandle mHandle;
+    const SlotLayout* mSlotLayout = nullptr;
 
     friend RuntimeManager;
   };
 
+  // Compressed sparse row copy of the connections between everything a set of
+  // roots reaches.  Slots stay the source of truth, Connect and Disconnect
+  // edit them and Build flattens them again.  Nodes get dense ids in
+  // topological order so a pass over 0..GetNodeCount() sees every producer
+  // before its readers and walks each array front to back.
+  //
+  // Every edge is 8 bytes per direction.  Only readers inside the table are
+  // recorded, an input with more than one connection only keeps the first.
+  class EdgeTable
+  {
+  public:
+    static constexpr uint32_t NoNode = ~0u;
+
+    // For an input, the producer and which of its outputs.  For an output, the
+    // reader and which of its inputs.
+    struct Edge
+    {
+      uint32_t mNode;
+      uint32_t mSlot;
+    };
+
+    class EdgeRange
+    {
+    public:
+      EdgeRange(const Edge* begin, const Edge* end) : mBegin(begin), mEnd(end) {}
+
+      const Edge* begin() const { return mBegin; }
+      const Edge* end() const { return mEnd; }
+      size_t size() const { return mEnd - mBegin; }
+      bool empty() const { return mBegin == mEnd; }
+      const Edge& operator[](size_t i) const { return mBegin[i]; }
+
+    private:
+      const Edge* mBegin;
+      const Edge* mEnd;
+    };
+
+    // Fails on a cycle, the table is left empty then
+    bool Build(RuntimeManager* runtime, const std::vector<NodeHandle>& roots);
+    void Clear();
+
+    uint32_t GetNodeCount() const { return static_cast<uint32_t>(mOrder.size()); }
+    NodeHandle GetHandle(uint32_t node) const { return mOrder[node]; }
+    Node* GetNode(uint32_t node) const { return mNodes[node]; }
+
+    // NoNode if the node isn't in the table
+    uint32_t GetId(NodeHandle handle) const;
+
+    // Every node in id order, the same order TopologicalOrder gives
+    const std::vector<NodeHandle>& GetOrder() const { return mOrder; }
+
+    // One per input slot, mNode is NoNode where nothing's connected
+    EdgeRange GetInputs(uint32_t node) const
+    {
+      return EdgeRange(mInputs.data() + mInputStarts[node], mInputs.data() + mInputStarts[node + 1]);
+    }
+
+    // Output slots are numbered across the whole table, for dense side tables
+    // of per output values
+    uint32_t GetOutputIndex(uint32_t node, uint32_t slot) const { return mOutputStarts[node] + slot; }
+    uint32_t GetOutputCount() const { return mOutputStarts.empty() ? 0 : mOutputStarts.back(); }
+
+    EdgeRange GetReaders(uint32_t outputIndex) const
+    {
+      return EdgeRange(mReaders.data() + mReaderStarts[outputIndex], mReaders.data() + mReaderStarts[outputIndex + 1]);
+    }
+
+  private:
+    std::vector<NodeHandle> mOrder;
+    std::vector<Node*> mNodes;
+    std::vector<uint32_t> mIds; // Dense on NodeHandle::mIndex
+
+    std::vector<uint32_t> mInputStarts;  // Per node, one past the end for the last
+    std::vector<Edge> mInputs;
+
+    std::vector<uint32_t> mOutputStarts; // Per node, into output indices
+    std::vector<uint32_t> mReaderStarts; // Per output index
+    std::vector<Edge> mReaders;
+  };
+
+  // Owns the nodes made for one graph and frees them all together when it's
+  // destroyed or Released, so rebuilding a graph doesn't grow the runtime.
+  // Nodes still come out of the runtime's allocators, the arena just keeps
+  // their handles grouped by type so release is one FreeNodesByIndex per
+  // type.  Nodes freed on their own in the meantime are skipped.
+  //
+  // Nothing gets disconnected on release, anything still connected to an
+  // arena's nodes shouldn't be used afterwards.  The runtime has to outlive
+  // the arena.
+  class NodeArena
+  {
+  public:
+    NodeArena(RuntimeManager* manager);
+    ~NodeArena();
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    template<typename NodeType, typename... Args>
+    NodeType* AllocateAndGetWeakRefWithHandle(NodeHandle& handleLoc, Args&&... args)
+    {
+      NodeType* ref = mManager->AllocateAndGetWeakRefWithHandle<NodeType>(handleLoc, args...);
+      Track(RuntimeManager::GetTypeIndex<NodeType>(), handleLoc);
+      return ref;
+    }
+
+    template<typename NodeType, typename... Args>
+    NodeType* AllocateAndGetWeakRef(Args&&... args)
+    {
+      NodeHandle garbage;
+      return AllocateAndGetWeakRefWithHandle<NodeType>(garbage, args...);
+    }
+
+    NodeHandle AllocateNode(NodeTypeGUID type, void** args);
+
+    // Takes over nodes allocated straight from the runtime, GraphBuilder's
+    // for instance
+    void Adopt(NodeHandle handle);
+    void Adopt(const std::vector<NodeHandle>& handles);
+
+    // Frees every node, the arena can be used again afterwards
+    void Release();
+
+    // Walks the arena's handles, nodes freed outside of it count as freed.
+    // The peak is the most the arena has handed out between releases, it only
+    // notices nodes freed outside of it when it's released.
+    MemoryStats GetStats() const;
+
+    RuntimeManager* GetRuntime() const;
+
+  private:
+    void Track(NodeTypeIndex type, NodeHandle handle);
+
+    RuntimeManager* mManager;
+    std::vector<std::vector<NodeHandle>> mNodes; // Per NodeTypeIndex
+
+    uint64_t mAllocations = 0;
+    size_t mTrackedBytes = 0; // Handed out since the last release
+    size_t mPeakBytes = 0;
+  };
+
   // Does unessisary execution
   class NodeGraph
   {
   public:
     NodeGraph(RuntimeManager* manager);
+    NodeGraph(std::shared_ptr<NodeArena> arena);
 
     void Execute();
     RuntimeManager* GetRuntime() const;
 
-    std::vector<AllocatorFactory::AbsoluteBlockHandle> mFinals;
+    std::vector<NodeHandle> mFinals;
+
+    // Where nodes made for the graph go.  Copies of the graph and the forest
+    // Forestify makes from it share it, so its nodes live as long as any of
+    // them.
+    std::shared_ptr<NodeArena> mArena;
+
   private:
     RuntimeManager * mManager;
   };
@@ -228,12 +837,34 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
   {
   public:
     NodeForest(RuntimeManager* manager);
+    NodeForest(std::shared_ptr<NodeArena> arena);
 
     void Execute();
+
+    // Lowers and runs OptimizeIR first, same C++ as CodeEmitter::EmitIR.  If
+    // the forest doesn't lower the error is written instead.
     std::string ToCPP();
+    void ToCPP(std::ostream& out);
+
     RuntimeManager* GetRuntime() const;
 
-    std::vector<AllocatorFactory::AbsoluteBlockHandle> mRoots;
+    std::vector<NodeHandle> mRoots;
+
+    // Every node reachable from mRoots, inputs before the nodes that read them,
+    // with each root's tree laid out contiguously in mRoots order.  Filled in by
+    // Forestify so backends don't have to walk the graph again.
+    std::vector<NodeHandle> mTopologicalOrder;
+
+    // Connections between the nodes in mTopologicalOrder, ids are positions in
+    // it.  Built alongside it, empty if it hasn't been.
+    EdgeTable mEdges;
+
+    // Empty unless Forestify failed, in which case mRoots is empty as well
+    std::string mError;
+
+    // Shared with the graph it came from, holds the Stores and Loads Forestify
+    // adds and the literals OptimizeForest folds to
+    std::shared_ptr<NodeArena> mArena;
 
   private:
     RuntimeManager * mManager;
@@ -247,14 +878,12 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
   //
   ///////////////////////////////////////////////////////////////////////////////
 
-  std::string GenerateRandomVarName();
-
   class IntegerSlot : public Slot
   {
   public:
     SlotMixin(IntegerSlot);
 
-    IntegerSlot(Node* parent) : Slot(parent), mValue(0)
+    IntegerSlot(Node* parent) : Slot(parent, TypeGUID), mValue(0)
     {
     }
 
@@ -271,7 +900,6 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
     IntegerLiteralNode(int value) : IntegerLiteralNode()
     {
       mOut.mValue = value;
-      mValue = value;
     }
 
     std::vector<Slot*> GetInputs() override
@@ -286,17 +914,66 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
 
     void Execute() override {}
 
-    std::string ToCPP() override
+    bool ToIR(IRBuilder& builder) override;
+    bool FoldConstant(int& value) override;
+
+    uint64_t GetDataKey() override
     {
-      return std::to_string(mValue);
+      return static_cast<uint32_t>(mOut.mValue);
     }
 
     void Populate(void** args) override
     {
-      mValue = *static_cast<int*>(args[0]);
+      mOut.mValue = *static_cast<int*>(args[0]);
     }
 
+    // The value lives in mOut, nothing ever writes a literal's output
     IntegerSlot mOut;
+  };
+
+  // A value supplied by the host.  Execute reads mValue, the bytecode backends
+  // read input mIndex of whichever instance they're running.
+  class IntegerInputNode : public Node
+  {
+  public:
+    NodeMixin(IntegerInputNode);
+
+    IntegerInputNode() : mOut(this), mIndex(0), mValue(0) {}
+
+    IntegerInputNode(int index) : IntegerInputNode()
+    {
+      mIndex = index;
+    }
+
+    std::vector<Slot*> GetInputs() override
+    {
+      return {};
+    }
+
+    std::vector<Slot*> GetOutputs() override
+    {
+      return { &mOut };
+    }
+
+    void Execute() override
+    {
+      mOut.mValue = mValue;
+    }
+
+    bool ToIR(IRBuilder& builder) override;
+
+    uint64_t GetDataKey() override
+    {
+      return static_cast<uint32_t>(mIndex);
+    }
+
+    void Populate(void** args) override
+    {
+      mIndex = *static_cast<int*>(args[0]);
+    }
+
+    IntegerSlot mOut;
+    int mIndex;
     int mValue;
   };
 
@@ -321,19 +998,14 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
 
     void Execute() override
     {
-      mA.mConnectedTo[0].mOutput->mParent->Execute();
-      mB.mConnectedTo[0].mOutput->mParent->Execute();
+      mA.mConnectedTo[0]->GetParent()->Run();
+      mB.mConnectedTo[0]->GetParent()->Run();
 
-      mOut.mValue = static_cast<IntegerSlot*>(mA.mConnectedTo[0].mOutput)->mValue + static_cast<IntegerSlot*>(mB.mConnectedTo[0].mOutput)->mValue;
+      mOut.mValue = static_cast<IntegerSlot*>(mA.mConnectedTo[0])->mValue + static_cast<IntegerSlot*>(mB.mConnectedTo[0])->mValue;
     }
 
-    std::string ToCPP() override
-    {
-      std::string left = mA.mConnectedTo[0].mOutput->mParent->ToCPP();
-      std::string right = mB.mConnectedTo[0].mOutput->mParent->ToCPP();
-
-      return left + "+" + right;
-    }
+    bool ToIR(IRBuilder& builder) override;
+    bool FoldConstant(int& value) override;
 
     IntegerSlot mA;
     IntegerSlot mB;
@@ -362,19 +1034,59 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
 
     void Execute() override
     {
-      IntegerSlot* s = static_cast<IntegerSlot*>(mIn.mConnectedTo[0].mOutput);
-      s->mParent->Execute();
+      IntegerSlot* s = static_cast<IntegerSlot*>(mIn.mConnectedTo[0]);
+      s->GetParent()->Run();
 
       std::cout << s->mValue << std::endl;
     }
 
-    std::string ToCPP() override
+    bool ToIR(IRBuilder& builder) override;
+
+    IntegerSlot mIn;
+  };
+
+  // A value handed back to the host.  Execute leaves it in mValue, a
+  // transpiled forest writes it to output mIndex of its IO struct.
+  class IntegerOutputNode : public Node
+  {
+  public:
+    NodeMixin(IntegerOutputNode);
+
+    IntegerOutputNode() : mIn(this), mIndex(0), mValue(0) {}
+
+    IntegerOutputNode(int index) : IntegerOutputNode()
+    {
+      mIndex = index;
+    }
+
+    std::vector<Slot*> GetInputs() override
+    {
+      return { &mIn };
+    }
+
+    std::vector<Slot*> GetOutputs() override
+    {
+      return {};
+    }
+
+    void Execute() override
+    {
+      IntegerSlot* s = static_cast<IntegerSlot*>(mIn.mConnectedTo[0]);
+      s->GetParent()->Run();
+
+      mValue = s->mValue;
+    }
+
+    bool ToIR(IRBuilder& builder) override;
+
+    void Populate(void** args) override
     {
-      std::string internal = mIn.mConnectedTo[0].mOutput->mParent->ToCPP();
-      return "printf(\"%i\", " + internal + ")";
+      mIndex = *static_cast<int*>(args[0]);
     }
 
     IntegerSlot mIn;
+    int mIndex;
+    int mValue;
   };
 
   class StoreIntegerVariableNode : public Node
@@ -398,20 +1110,13 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
 
     void Execute() override
     {
-      mIn.mConnectedTo[0].mOutput->mParent->Execute();
+      mIn.mConnectedTo[0]->GetParent()->Run();
 
-      mValue = static_cast<IntegerSlot*>(mIn.mConnectedTo[0].mOutput)->mValue;
+      mValue = static_cast<IntegerSlot*>(mIn.mConnectedTo[0])->mValue;
     }
 
-    std::string ToCPP() override
-    {
-      std::string internal = mIn.mConnectedTo[0].mOutput->mParent->ToCPP();
-      mName = GenerateRandomVarName();
-
-      return "int " + mName + " = " + internal;
-    }
+    bool ToIR(IRBuilder& builder) override;
 
-    std::string mName;
     int mValue;
 
     IntegerSlot mIn;
@@ -426,7 +1131,7 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
     {
     }
 
-    LoadIntegerVariableNode(AllocatorFactory::AbsoluteBlockHandle storeIntegerVariableNodeHandle) : LoadIntegerVariableNode()
+    LoadIntegerVariableNode(NodeHandle storeIntegerVariableNodeHandle) : LoadIntegerVariableNode()
     {
       mPair = storeIntegerVariableNodeHandle;
     }
@@ -443,18 +1148,18 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
 
     void Execute() override
     {
-      mOut.mValue = static_cast<StoreIntegerVariableNode*>(GetRuntime()->GetAllocatorFactory()->GetWeakRef(mPair))->mValue;
+      mOut.mValue = static_cast<StoreIntegerVariableNode*>(GetRuntime()->GetWeakRef(mPair))->mValue;
     }
 
-    std::string ToCPP() override
-    {
-      return static_cast<StoreIntegerVariableNode*>(GetRuntime()->GetAllocatorFactory()->GetWeakRef(mPair))->mName;
-    }
+    bool ToIR(IRBuilder& builder) override;
+    bool FoldConstant(int& value) override;
+
+    NodeHandle GetPair() const { return mPair; }
 
     IntegerSlot mOut;
 
   private:
-    AllocatorFactory::AbsoluteBlockHandle mPair;
+    NodeHandle mPair;
   };
 
   ///////////////////////////////////////////////////////////////////////////////
@@ -462,10 +1167,16 @@ CAN::NodeTypeGUID GetTypeGUID() override { return TypeGUID; }
   ///////////////////////////////////////////////////////////////////////////////
 
   // Will ruin cluster FYI
-  NodeGraph NodeClusterToNodeGraph(RuntimeManager* runtime, std::vector<AllocatorFactory::AbsoluteBlockHandle>& nodes);
+  NodeGraph NodeClusterToNodeGraph(RuntimeManager* runtime, std::vector<NodeHandle>& nodes);
+
+  // Same, for a cluster allocated out of arena
+  NodeGraph NodeClusterToNodeGraph(std::shared_ptr<NodeArena> arena, std::vector<NodeHandle>& nodes);
 
-  void RecursiveOutputCheck(Node* node, std::vector<AllocatorFactory::AbsoluteBlockHandle>& roots);
+  // Post order of everything reachable from roots.  Returns false if the nodes
+  // form a cycle.
+  bool TopologicalOrder(RuntimeManager* runtime, const std::vector<NodeHandle>& roots, std::vector<NodeHandle>& order);
 
   // Will ruin graph FYI
+  // Runs in O(nodes + connections), check mError on the result for cycles
   NodeForest Forestify(NodeGraph ng);
 }
@@ -0,0 +1,271 @@
+﻿#include "CodeEmitter.h"
+#include "Optimize.h"
+#include "SourceMap.h"
+
+#include <algorithm>
+#include <cctype>
+#include <sstream>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 Code Emitter
+///////////////////////////////////////////////////////////////////////////////
+
+CodeEmitter::CodeEmitter(RuntimeManager* runtime, std::ostream& out) : mManager(runtime), mOut(out) {}
+
+void CodeEmitter::SetSourceMap(SourceMap* map, uint32_t firstLine)
+{
+  mMap = map;
+  mLine = firstLine;
+}
+
+void CodeEmitter::EmitIR(const IRProgram& program)
+{
+  BeginLine();
+  mOut << "{";
+  EndLine();
+
+  ++mIndent;
+
+  for (size_t i = 0; i < program.mInstructions.size(); ++i)
+  {
+    const IRInstruction& instruction = program.mInstructions[i];
+
+    if (mMap)
+    {
+      uint32_t node = mMap->AddNode(mManager, instruction.mSource);
+
+      if (!mMap->mLineFile.empty())
+      {
+        LineDirective(node + 1, mMap->mLineFile);
+      }
+
+      mMap->AddLine(mLine, node);
+    }
+
+    BeginLine();
+
+    switch (instruction.mOp)
+    {
+    case IROp::Constant:
+      mOut << "int v" << i << " = " << instruction.mImmediate;
+      break;
+    case IROp::Input:
+      mOut << "int v" << i << " = ";
+      IOField("in", instruction.mImmediate);
+      break;
+    case IROp::Add:
+      mOut << "int v" << i << " = v" << instruction.mOperands[0] << "+v" << instruction.mOperands[1];
+      break;
+    case IROp::Print:
+      mOut << "printf(\"%i\\n\", v" << instruction.mOperands[0] << ")";
+      break;
+    case IROp::Output:
+      IOField("out", instruction.mImmediate);
+      mOut << " = v" << instruction.mOperands[0];
+      break;
+    }
+
+    mOut << ";";
+    EndLine();
+  }
+
+  if (mMap && !mMap->mLineFile.empty())
+  {
+    LineDirective(mLine + 1, mMap->mFile);
+  }
+
+  --mIndent;
+
+  BeginLine();
+  mOut << "}";
+  EndLine();
+}
+
+void CodeEmitter::SetIOPrefix(const char* prefix)
+{
+  mIOPrefix = prefix;
+}
+
+void CodeEmitter::IOField(const char* field, int index)
+{
+  mOut << mIOPrefix << field << index;
+}
+
+void CodeEmitter::LineDirective(uint32_t line, const std::string& file)
+{
+  BeginLine();
+  mOut << "#line " << line;
+
+  if (!file.empty())
+  {
+    mOut << " \"" << file << "\"";
+  }
+
+  EndLine();
+}
+
+void CodeEmitter::BeginLine()
+{
+  for (unsigned i = 0; i < mIndent; ++i)
+  {
+    mOut << "  ";
+  }
+}
+
+void CodeEmitter::EndLine()
+{
+  mOut << "\n";
+  ++mLine;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                             Translation Unit
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  bool IsIdentifier(const std::string& name)
+  {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])))
+    {
+      return false;
+    }
+
+    for (char c : name)
+    {
+      if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  void WriteHeader(const std::string& name, uint32_t inputCount, uint32_t outputCount, std::ostream& header)
+  {
+    const std::string io = name + "_IO";
+
+    header << "// Generated by CAN, do not edit\n";
+    header << "#pragma once\n\n";
+    header << "#include <stddef.h>\n\n";
+    header << "#ifdef __cplusplus\n";
+    header << "extern \"C\" {\n";
+    header << "#endif\n\n";
+    header << "typedef struct " << io << "\n";
+    header << "{\n";
+
+    for (uint32_t i = 0; i < inputCount; ++i)
+    {
+      header << "  int in" << i << ";\n";
+    }
+
+    for (uint32_t i = 0; i < outputCount; ++i)
+    {
+      header << "  int out" << i << ";\n";
+    }
+
+    // C doesn't allow empty structs
+    if (inputCount + outputCount == 0)
+    {
+      header << "  int unused;\n";
+    }
+
+    header << "} " << io << ";\n\n";
+    header << "void " << name << "_Run(" << io << "* io);\n";
+    header << "void " << name << "_RunBatch(" << io << "* io, size_t count);\n\n";
+    header << "#ifdef __cplusplus\n";
+    header << "}\n";
+    header << "#endif\n";
+  }
+
+  // The body goes between the prologue and the epilogue.  Returns the line
+  // the body starts on.
+  uint32_t WriteSourcePrologue(const std::string& name, std::ostream& source)
+  {
+    std::ostringstream prologue;
+    prologue << "// Generated by CAN, do not edit\n";
+    prologue << "#include \"" << name << ".h\"\n\n";
+    prologue << "#include <stdio.h>\n\n";
+    prologue << "static inline void " << name << "_Body(" << name << "_IO* io)\n";
+
+    const std::string text = prologue.str();
+    source << text;
+
+    return uint32_t(std::count(text.begin(), text.end(), '\n')) + 1;
+  }
+
+  void SetUpSourceMap(CodeEmitter& emitter, SourceMap* map, const std::string& name, uint32_t firstLine)
+  {
+    if (!map)
+    {
+      return;
+    }
+
+    if (map->mFile.empty())
+    {
+      map->mFile = name + ".cpp";
+    }
+
+    emitter.SetSourceMap(map, firstLine);
+  }
+
+  void WriteSourceEpilogue(const std::string& name, std::ostream& source)
+  {
+    const std::string io = name + "_IO";
+
+    source << "\n";
+    source << "extern \"C\" void " << name << "_Run(" << io << "* io)\n";
+    source << "{\n";
+    source << "  " << name << "_Body(io);\n";
+    source << "}\n\n";
+    source << "extern \"C\" void " << name << "_RunBatch(" << io << "* io, size_t count)\n";
+    source << "{\n";
+    source << "  for (size_t i = 0; i < count; ++i)\n";
+    source << "  {\n";
+    source << "    " << name << "_Body(io + i);\n";
+    source << "  }\n";
+    source << "}\n";
+  }
+}
+
+bool CAN::WriteTranslationUnit(const IRProgram& program, const std::string& name, std::ostream& header, std::ostream& source, std::string& error, SourceMap* map, RuntimeManager* runtime)
+{
+  if (!IsIdentifier(name))
+  {
+    error = "WriteTranslationUnit: '" + name + "' isn't a C identifier";
+    return false;
+  }
+
+  WriteHeader(name, program.mInputCount, program.mOutputCount, header);
+  uint32_t firstLine = WriteSourcePrologue(name, source);
+
+  CodeEmitter emitter(runtime, source);
+  SetUpSourceMap(emitter, map, name, firstLine);
+  emitter.SetIOPrefix("io->");
+  emitter.EmitIR(program);
+
+  WriteSourceEpilogue(name, source);
+  return true;
+}
+
+bool CAN::WriteTranslationUnit(const NodeForest& forest, const std::string& name, std::ostream& header, std::ostream& source, std::string& error, SourceMap* map)
+{
+  if (!forest.mError.empty())
+  {
+    error = forest.mError;
+    return false;
+  }
+
+  IRProgram program;
+  IRBuilder builder(forest.GetRuntime());
+  if (!builder.Lower(forest, program, error))
+  {
+    return false;
+  }
+
+  OptimizeIR(program);
+  return WriteTranslationUnit(program, name, header, source, error, map, forest.GetRuntime());
+}
@@ -0,0 +1,87 @@
+﻿#pragma once
+
+#include "CAN.h"
+#include "IR.h"
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+namespace CAN
+{
+  class SourceMap;
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                 Code Emitter
+  ///////////////////////////////////////////////////////////////////////////////
+  // Streams C++ out of an IRProgram, one statement per instruction with value
+  // n in vn, so the same program always comes out byte for byte the same.
+  // Graphs get here through IRBuilder::Lower and OptimizeIR.  Every value is
+  // an int for now.
+  //
+  // With a SourceMap set every instruction's line gets recorded against the
+  // node it was lowered from, see SourceMap.h.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class CodeEmitter
+  {
+  public:
+    // runtime is only used to fill in the source map's blocks and types, it
+    // can be null
+    CodeEmitter(RuntimeManager* runtime, std::ostream& out);
+
+    // Before emitting anything.  firstLine is the line of out the emitter's
+    // output starts on, so the map matches the whole file.
+    void SetSourceMap(SourceMap* map, uint32_t firstLine = 1);
+
+    // "{ statement; statement; ... }"
+    void EmitIR(const IRProgram& program);
+
+    // Host inputs and outputs are written as prefix + field + index, in0 and
+    // out0 for a bare block or io->in0 inside a translation unit
+    void SetIOPrefix(const char* prefix);
+
+  private:
+    void IOField(const char* field, int index);
+    void LineDirective(uint32_t line, const std::string& file);
+
+    void BeginLine();
+    void EndLine();
+
+    RuntimeManager* mManager;
+    std::ostream& mOut;
+    unsigned mIndent = 0;
+    const char* mIOPrefix = "";
+
+    SourceMap* mMap = nullptr;
+    uint32_t mLine = 1;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                             Translation Unit
+  ///////////////////////////////////////////////////////////////////////////////
+  // A header and source pair for one program that builds on its own and links
+  // into the host with no CAN runtime behind it.  For a program named Name:
+  //
+  //   typedef struct Name_IO { int in0; ... int out0; ... } Name_IO;
+  //
+  //   void Name_Run(Name_IO* io);
+  //   void Name_RunBatch(Name_IO* io, size_t count);
+  //
+  // Both are extern "C".  Fields go up to mInputCount and mOutputCount, gaps
+  // included, so the layout only depends on the indices.  Inputs are only
+  // read, outputs nothing writes are left alone.  RunBatch runs io[0] through
+  // io[count - 1] in order.  Prints still printf.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  // source includes header as name + ".h".  Fails if name isn't a C
+  // identifier.  map, if given, covers source and gets name + ".cpp" as its
+  // mFile unless one is already set.  runtime, if given, fills in the map's
+  // blocks and types, the nodes the program came from have to still be alive.
+  bool WriteTranslationUnit(const IRProgram& program, const std::string& name, std::ostream& header, std::ostream& source, std::string& error, SourceMap* map = nullptr, RuntimeManager* runtime = nullptr);
+
+  // Same for a forest, lowered and run through OptimizeIR first with the
+  // forest's runtime filling in the map.  Also fails if the forest has mError
+  // set or doesn't lower.
+  bool WriteTranslationUnit(const NodeForest& forest, const std::string& name, std::ostream& header, std::ostream& source, std::string& error, SourceMap* map = nullptr);
+}
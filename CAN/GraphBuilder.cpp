@@ -0,0 +1,264 @@
+﻿#include "GraphBuilder.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                Graph Builder
+///////////////////////////////////////////////////////////////////////////////
+
+GraphBuilder::GraphBuilder(RuntimeManager* runtime) : mManager(runtime) {}
+
+bool GraphBuilder::Build(const std::vector<NodeRecord>& nodes, const std::vector<EdgeRecord>& edges, std::vector<NodeHandle>& handles, std::string& error)
+{
+  return Build(nodes.data(), nodes.size(), edges.data(), edges.size(), handles, error);
+}
+
+bool GraphBuilder::Build(const NodeRecord* nodes, size_t nodeCount, const EdgeRecord* edges, size_t edgeCount, std::vector<NodeHandle>& handles, std::string& error)
+{
+  handles.clear();
+
+  if (!Validate(nodes, nodeCount, edges, edgeCount, error))
+  {
+    return false;
+  }
+
+  handles.resize(nodeCount);
+  mRefs.resize(nodeCount);
+  mTypeStarts.resize(mTypeCount);
+  mManager->ReserveNodes(nodeCount);
+
+  // The records are made a window at a time, each window sorted by type so
+  // every type in it comes out of one AllocateNodesByIndex.  Edges go in as
+  // soon as both their nodes exist, so with edges in roughly node order, as
+  // importers write them, a window is connected while it's still in cache.
+  // An edge further along holds up the ones after it until its nodes are made.
+  uint32_t batch[BatchSize];
+  void** args[BatchSize];
+  NodeHandle made[BatchSize];
+  Node* madeRefs[BatchSize];
+  size_t edge = 0;
+
+  for (size_t first = 0; first < nodeCount; first += BatchSize)
+  {
+    const size_t last = std::min(first + BatchSize, nodeCount);
+
+    for (const auto& seen : mSeenTypes)
+    {
+      mTypeStarts[seen.second] = 0;
+    }
+
+    for (size_t i = first; i < last; ++i)
+    {
+      ++mTypeStarts[mTypes[i]];
+    }
+
+    uint32_t start = 0;
+    for (const auto& seen : mSeenTypes)
+    {
+      uint32_t count = mTypeStarts[seen.second];
+      mTypeStarts[seen.second] = start;
+      start += count;
+    }
+
+    for (size_t i = first; i < last; ++i)
+    {
+      uint32_t k = mTypeStarts[mTypes[i]]++;
+      batch[k] = static_cast<uint32_t>(i);
+      args[k] = nodes[i].mArgs;
+    }
+
+    // Each start has moved on to the end of its type's run
+    uint32_t begin = 0;
+    for (const auto& seen : mSeenTypes)
+    {
+      uint32_t end = mTypeStarts[seen.second];
+
+      if (end > begin)
+      {
+        mManager->AllocateNodesByIndex(seen.second, end - begin, args + begin, made + begin, madeRefs + begin);
+      }
+
+      // Outputs with more than one reader get room for all of them up front,
+      // a slot already keeps one connection inline
+      for (uint32_t k = begin; k < end && mTypeSlots[seen.second].mFansOut; ++k)
+      {
+        const uint8_t* readers = mReaders.data() + size_t(batch[k]) * mMaxOutputs;
+        if (*std::max_element(readers, readers + mMaxOutputs) > 1)
+        {
+          for (Slot* output : madeRefs[k]->GetOutputSlots())
+          {
+            output->mConnectedTo.reserve(*readers++);
+          }
+        }
+      }
+
+      begin = end;
+    }
+
+    for (uint32_t k = 0; k < last - first; ++k)
+    {
+      handles[batch[k]] = made[k];
+      mRefs[batch[k]] = madeRefs[k];
+    }
+
+    // The last window is every node, so nothing is left over after it
+    for (; edge < edgeCount; ++edge)
+    {
+      const EdgeRecord& record = edges[edge];
+
+      if (std::max(record.mInputNode, record.mOutputNode) >= last)
+      {
+        break;
+      }
+
+      Slot* input = mRefs[record.mInputNode]->GetInputSlots()[record.mInputSlot];
+      Slot* output = mRefs[record.mOutputNode]->GetOutputSlots()[record.mOutputSlot];
+
+      input->Connect(output);
+    }
+  }
+
+  return true;
+}
+
+bool GraphBuilder::Validate(const NodeRecord* nodes, size_t nodeCount, const EdgeRecord* edges, size_t edgeCount, std::string& error)
+{
+  if (nodeCount >= UINT32_MAX)
+  {
+    error = "GraphBuilder: too many nodes";
+    return false;
+  }
+
+  if (edgeCount >= UINT32_MAX)
+  {
+    error = "GraphBuilder: too many edges";
+    return false;
+  }
+
+  mTypes.resize(nodeCount);
+  mTypeCount = 0;
+  mMaxInputs = 0;
+  mMaxOutputs = 0;
+  mSeenTypes.clear();
+  mTypeSlots.clear();
+
+  // A graph only uses a handful of types, so they're looked up through a small
+  // cache keyed on the GUID's low bits and then the ones already seen before
+  // the runtime's map.  Types that interleave hit the cache as well as runs do.
+  std::fill(std::begin(mCachedTypes), std::end(mCachedTypes), InvalidNodeTypeIndex);
+
+  for (size_t i = 0; i < nodeCount; ++i)
+  {
+    const size_t cached = nodes[i].mType % TypeCacheSize;
+    NodeTypeIndex type = mCachedTypes[cached];
+
+    if (type == InvalidNodeTypeIndex || mCachedGUIDs[cached] != nodes[i].mType)
+    {
+      auto seen = std::find_if(mSeenTypes.begin(), mSeenTypes.end(), [&](const std::pair<NodeTypeGUID, NodeTypeIndex>& s) { return s.first == nodes[i].mType; });
+
+      if (seen != mSeenTypes.end())
+      {
+        type = seen->second;
+      }
+      else
+      {
+        type = mManager->GetTypeIndex(nodes[i].mType);
+
+        if (type == InvalidNodeTypeIndex)
+        {
+          error = "GraphBuilder: node " + std::to_string(i) + " has an unregistered type";
+          return false;
+        }
+
+        const NodeTypeInfo& info = mManager->GetTypeInfo(type);
+
+        mSeenTypes.emplace_back(nodes[i].mType, type);
+        mTypeCount = std::max(mTypeCount, type + 1);
+
+        // The edge checks read these for every edge, flat rather than through
+        // the type info's layout and vectors
+        mTypeSlots.resize(mTypeCount);
+        Slots& slots = mTypeSlots[type];
+        slots.mInputs = static_cast<uint32_t>(info.mSlotLayout->mInputOffsets.size());
+        slots.mOutputs = static_cast<uint32_t>(info.mSlotLayout->mOutputOffsets.size());
+        slots.mInputTypes = info.mInputTypes.data();
+        slots.mOutputTypes = info.mOutputTypes.data();
+        slots.mInputTypeCount = static_cast<uint32_t>(info.mInputTypes.size());
+        slots.mOutputTypeCount = static_cast<uint32_t>(info.mOutputTypes.size());
+
+        mMaxInputs = std::max(mMaxInputs, slots.mInputs);
+        mMaxOutputs = std::max(mMaxOutputs, slots.mOutputs);
+      }
+
+      mCachedGUIDs[cached] = nodes[i].mType;
+      mCachedTypes[cached] = type;
+    }
+
+    mTypes[i] = type;
+  }
+
+  // Strided by the most slots any type has so no per node offsets are needed
+  mFilled.assign(nodeCount * mMaxInputs, false);
+  mReaders.assign(nodeCount * mMaxOutputs, 0);
+
+  // Locals rather than members in the loop, the reader counts are bytes and a
+  // store through a byte could alias any member so they'd all be reloaded
+  const NodeTypeIndex* types = mTypes.data();
+  Slots* typeSlots = mTypeSlots.data();
+  std::vector<bool>::iterator filled = mFilled.begin();
+  uint8_t* readerCounts = mReaders.data();
+  const size_t maxInputs = mMaxInputs;
+  const size_t maxOutputs = mMaxOutputs;
+
+  for (size_t e = 0; e < edgeCount; ++e)
+  {
+    const EdgeRecord& edge = edges[e];
+
+    if (edge.mInputNode >= nodeCount || edge.mOutputNode >= nodeCount)
+    {
+      error = "GraphBuilder: edge " + std::to_string(e) + " node out of range";
+      return false;
+    }
+
+    const Slots& in = typeSlots[types[edge.mInputNode]];
+    Slots& out = typeSlots[types[edge.mOutputNode]];
+
+    if (edge.mInputSlot >= in.mInputs || edge.mOutputSlot >= out.mOutputs)
+    {
+      error = "GraphBuilder: edge " + std::to_string(e) + " slot out of range";
+      return false;
+    }
+
+    // Registered slot types, so no node has to exist to check them
+    if (edge.mInputSlot < in.mInputTypeCount && edge.mOutputSlot < out.mOutputTypeCount &&
+        in.mInputTypes[edge.mInputSlot] != out.mOutputTypes[edge.mOutputSlot])
+    {
+      const std::string& inName = mManager->GetTypeInfo(types[edge.mInputNode]).mName;
+      const std::string& outName = mManager->GetTypeInfo(types[edge.mOutputNode]).mName;
+
+      error = "GraphBuilder: edge " + std::to_string(e) + " connects " + inName + " to " + outName + " with mismatched slot types";
+      return false;
+    }
+
+    size_t input = edge.mInputNode * maxInputs + edge.mInputSlot;
+    if (filled[input])
+    {
+      error = "GraphBuilder: edge " + std::to_string(e) + " goes into an input another edge already connects";
+      return false;
+    }
+
+    filled[input] = true;
+
+    // Only used to reserve, so it stops counting rather than wrapping
+    uint8_t& readers = readerCounts[edge.mOutputNode * maxOutputs + edge.mOutputSlot];
+    if (readers < UINT8_MAX && ++readers == 2)
+    {
+      out.mFansOut = true;
+    }
+  }
+
+  return true;
+}
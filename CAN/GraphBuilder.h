@@ -0,0 +1,95 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                Graph Builder
+  ///////////////////////////////////////////////////////////////////////////////
+  // Makes a whole graph out of flat node and edge arrays instead of one
+  // AllocateNode and Connect at a time, for importers that already have their
+  // graph as tables.
+  //
+  // Every record is checked before anything is allocated so a bad one leaves
+  // the runtime untouched.  The nodes are then made a window of records at a
+  // time, each type in the window out of one Allocator::AllocateBulk, with the
+  // handle table and every fanned out connection list sized once up front.
+  // An edge is connected as soon as both its nodes are made, so edges written
+  // in roughly node order go in while their nodes are still in cache.
+  //
+  // The checks are extra work building as you go doesn't do, so on the
+  // benchmark graphs this comes out about level with AllocateNode and Connect
+  // rather than ahead, and a little behind on small graphs that fan out a lot.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class GraphBuilder
+  {
+  public:
+    struct NodeRecord
+    {
+      NodeTypeGUID mType;
+      void** mArgs; // Handed to Populate, nullptr if the type doesn't read any
+    };
+
+    // Nodes are indices into the node records, slots are indices into the
+    // type's inputs or outputs in registration order
+    struct EdgeRecord
+    {
+      uint32_t mInputNode;
+      uint32_t mInputSlot;
+      uint32_t mOutputNode;
+      uint32_t mOutputSlot;
+    };
+
+    GraphBuilder(RuntimeManager* runtime);
+
+    // handles gets one handle per node record in the same order.  Fails on an
+    // unregistered type, a node or slot out of range, an edge between slots
+    // registered with different types, or two edges into the same input.
+    bool Build(const NodeRecord* nodes, size_t nodeCount, const EdgeRecord* edges, size_t edgeCount, std::vector<NodeHandle>& handles, std::string& error);
+    bool Build(const std::vector<NodeRecord>& nodes, const std::vector<EdgeRecord>& edges, std::vector<NodeHandle>& handles, std::string& error);
+
+  private:
+    bool Validate(const NodeRecord* nodes, size_t nodeCount, const EdgeRecord* edges, size_t edgeCount, std::string& error);
+
+    // Node records made at a time
+    static const uint32_t BatchSize = 1024;
+
+    // Entries in the GUID to type index cache Validate looks in first
+    static const size_t TypeCacheSize = 64;
+
+    // A type's slot counts and registered slot types, see Validate
+    struct Slots
+    {
+      uint32_t mInputs = 0;
+      uint32_t mOutputs = 0;
+      uint32_t mInputTypeCount = 0;
+      uint32_t mOutputTypeCount = 0;
+      const SlotTypeGUID* mInputTypes = nullptr;
+      const SlotTypeGUID* mOutputTypes = nullptr;
+      bool mFansOut = false; // Some output of some node of the type has more than one reader
+    };
+
+    RuntimeManager* mManager;
+
+    // Scratch, kept around so repeated builds don't reallocate
+    std::vector<NodeTypeIndex> mTypes;    // Per node
+    std::vector<Node*> mRefs;             // Per node, so edges skip the handle table
+    std::vector<std::pair<NodeTypeGUID, NodeTypeIndex>> mSeenTypes;
+    NodeTypeGUID mCachedGUIDs[TypeCacheSize];
+    NodeTypeIndex mCachedTypes[TypeCacheSize];
+    NodeTypeIndex mTypeCount = 0;         // One past the largest in mTypes
+    uint32_t mMaxInputs = 0;              // Most inputs any node has
+    uint32_t mMaxOutputs = 0;             // Most outputs any node has
+    std::vector<bool> mFilled;            // Per node and input, mMaxInputs apart
+    std::vector<uint8_t> mReaders;        // Per node and output, mMaxOutputs apart
+    std::vector<Slots> mTypeSlots;        // Per type index
+    std::vector<uint32_t> mTypeStarts;    // Per type index, where its nodes go in a window
+  };
+}
@@ -0,0 +1,599 @@
+﻿#include "GraphFile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace CAN;
+using namespace CAN::GraphFile;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                              Graph File View
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  bool InBounds(uint64_t offset, uint64_t count, uint64_t recordSize, uint64_t size)
+  {
+    return offset <= size && count <= (size - offset) / recordSize;
+  }
+
+  bool UniqueUIDs(const NodeRecord* nodes, uint32_t count)
+  {
+    uint32_t largest = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      largest = std::max(largest, nodes[i].mUID);
+    }
+
+    // The editor hands UIDs out densely, so a bit per possible UID is usually
+    // small and a lot cheaper than hashing them.  Sparse ones get sorted.
+    if (largest / 8 <= count)
+    {
+      std::vector<bool> seen(size_t(largest) + 1);
+
+      for (uint32_t i = 0; i < count; ++i)
+      {
+        if (seen[nodes[i].mUID])
+        {
+          return false;
+        }
+
+        seen[nodes[i].mUID] = true;
+      }
+
+      return true;
+    }
+
+    std::vector<uint32_t> uids(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      uids[i] = nodes[i].mUID;
+    }
+
+    std::sort(uids.begin(), uids.end());
+    return std::adjacent_find(uids.begin(), uids.end()) == uids.end();
+  }
+}
+
+bool GraphFileView::Open(const void* data, size_t size)
+{
+  mData = static_cast<const char*>(data);
+  mHeader = nullptr;
+  mError.clear();
+
+  if (size < sizeof(Header))
+  {
+    return Fail("GraphFile: too small for a header");
+  }
+
+  const Header* header = reinterpret_cast<const Header*>(mData);
+
+  if (std::memcmp(header->mMagic, Magic, sizeof(Magic)) != 0)
+  {
+    return Fail("GraphFile: not a graph file");
+  }
+
+  if (header->mVersion != Version)
+  {
+    return Fail("GraphFile: unsupported version");
+  }
+
+  if (header->mNodesOffset % alignof(NodeRecord) != 0 || header->mEdgesOffset % alignof(EdgeRecord) != 0)
+  {
+    return Fail("GraphFile: misaligned table");
+  }
+
+  if (!InBounds(header->mNodesOffset, header->mNodeCount, sizeof(NodeRecord), size) ||
+      !InBounds(header->mEdgesOffset, header->mEdgeCount, sizeof(EdgeRecord), size) ||
+      !InBounds(header->mStringsOffset, header->mStringsSize, 1, size))
+  {
+    return Fail("GraphFile: table runs past the end of the file");
+  }
+
+  const char* strings = mData + header->mStringsOffset;
+  if (header->mStringsSize == 0 || strings[header->mStringsSize - 1] != '\0')
+  {
+    return Fail("GraphFile: string table isn't terminated");
+  }
+
+  const NodeRecord* nodes = reinterpret_cast<const NodeRecord*>(mData + header->mNodesOffset);
+  for (uint32_t i = 0; i < header->mNodeCount; ++i)
+  {
+    if (nodes[i].mTypeName >= header->mStringsSize)
+    {
+      return Fail("GraphFile: node type name out of range");
+    }
+
+    if (nodes[i].mFirstEdge > header->mEdgeCount || nodes[i].mEdgeCount > header->mEdgeCount - nodes[i].mFirstEdge)
+    {
+      return Fail("GraphFile: node edge range out of range");
+    }
+  }
+
+  // Edges are stored as indices but UIDs are how the editor and source maps
+  // name nodes, two the same would make them ambiguous
+  if (!UniqueUIDs(nodes, header->mNodeCount))
+  {
+    return Fail("GraphFile: duplicate node uid");
+  }
+
+  const EdgeRecord* edges = reinterpret_cast<const EdgeRecord*>(mData + header->mEdgesOffset);
+  for (uint32_t i = 0; i < header->mEdgeCount; ++i)
+  {
+    if (edges[i].mInputNode >= header->mNodeCount || edges[i].mOutputNode >= header->mNodeCount)
+    {
+      return Fail("GraphFile: edge node out of range");
+    }
+  }
+
+  mHeader = header;
+  return true;
+}
+
+uint32_t GraphFileView::GetNodeCount() const { return mHeader ? mHeader->mNodeCount : 0; }
+uint32_t GraphFileView::GetEdgeCount() const { return mHeader ? mHeader->mEdgeCount : 0; }
+
+const NodeRecord* GraphFileView::GetNodes() const
+{
+  return reinterpret_cast<const NodeRecord*>(mData + mHeader->mNodesOffset);
+}
+
+const EdgeRecord* GraphFileView::GetEdges() const
+{
+  return reinterpret_cast<const EdgeRecord*>(mData + mHeader->mEdgesOffset);
+}
+
+const char* GraphFileView::GetString(uint32_t offset) const
+{
+  return mData + mHeader->mStringsOffset + offset;
+}
+
+const std::string& GraphFileView::GetError() const { return mError; }
+
+bool GraphFileView::Fail(const char* error)
+{
+  mHeader = nullptr;
+  mError = error;
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                            Mapped Graph File
+///////////////////////////////////////////////////////////////////////////////
+
+MappedGraphFile::~MappedGraphFile()
+{
+  Close();
+}
+
+bool MappedGraphFile::Open(const char* path)
+{
+  Close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    mError = "GraphFile: couldn't open file";
+    return false;
+  }
+
+  mFile = file;
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+  {
+    mError = "GraphFile: empty file";
+    Close();
+    return false;
+  }
+
+  mMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  mData = mMapping ? MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+  mSize = static_cast<size_t>(size.QuadPart);
+#else
+  int file = open(path, O_RDONLY);
+  if (file < 0)
+  {
+    mError = "GraphFile: couldn't open file";
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(file, &info) != 0 || info.st_size == 0)
+  {
+    close(file);
+    mError = "GraphFile: empty file";
+    return false;
+  }
+
+  // The mapping keeps the file alive on its own
+  void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+
+  mData = data == MAP_FAILED ? nullptr : data;
+  mSize = static_cast<size_t>(info.st_size);
+#endif
+
+  if (!mData)
+  {
+    mError = "GraphFile: couldn't map file";
+    Close();
+    return false;
+  }
+
+  if (!mView.Open(mData, mSize))
+  {
+    mError = mView.GetError();
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+void MappedGraphFile::Close()
+{
+#ifdef _WIN32
+  if (mData)
+  {
+    UnmapViewOfFile(mData);
+  }
+
+  if (mMapping)
+  {
+    CloseHandle(mMapping);
+  }
+
+  if (mFile)
+  {
+    CloseHandle(mFile);
+  }
+
+  mFile = nullptr;
+  mMapping = nullptr;
+#else
+  if (mData)
+  {
+    munmap(const_cast<void*>(mData), mSize);
+  }
+#endif
+
+  mData = nullptr;
+  mSize = 0;
+  mView = GraphFileView();
+}
+
+const GraphFileView& MappedGraphFile::GetView() const { return mView; }
+const std::string& MappedGraphFile::GetError() const { return mError; }
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                           Graph File Builder
+///////////////////////////////////////////////////////////////////////////////
+
+void GraphFileBuilder::AddNode(const char* typeName, size_t typeNameLength, uint32_t uid, float x, float y, uint64_t userData)
+{
+  NodeRecord node;
+  node.mUID = uid;
+  node.mTypeName = InternString(typeName, typeNameLength);
+  node.mX = x;
+  node.mY = y;
+  node.mUserData = userData;
+  node.mFirstEdge = static_cast<uint32_t>(mEdges.size());
+  node.mEdgeCount = 0;
+
+  mNodes.push_back(node);
+}
+
+void GraphFileBuilder::AddEdge(uint32_t inputSlot, uint32_t outputNodeUID, uint32_t outputSlot, float controlX, float controlY)
+{
+  assert(!mNodes.empty());
+
+  EdgeRecord edge;
+  edge.mInputNode = static_cast<uint32_t>(mNodes.size() - 1);
+  edge.mInputSlot = inputSlot;
+  edge.mOutputNode = outputNodeUID;
+  edge.mOutputSlot = outputSlot;
+  edge.mControlX = controlX;
+  edge.mControlY = controlY;
+
+  mEdges.push_back(edge);
+  ++mNodes.back().mEdgeCount;
+}
+
+bool GraphFileBuilder::Write(std::vector<char>& out, std::string& error) const
+{
+  std::unordered_map<uint32_t, uint32_t> uidToIndex;
+  for (uint32_t i = 0; i < mNodes.size(); ++i)
+  {
+    if (!uidToIndex.emplace(mNodes[i].mUID, i).second)
+    {
+      error = "GraphFile: duplicate node uid " + std::to_string(mNodes[i].mUID);
+      out.clear();
+      return false;
+    }
+  }
+
+  Header header = {};
+  std::memcpy(header.mMagic, Magic, sizeof(Magic));
+  header.mVersion = Version;
+  header.mNodeCount = static_cast<uint32_t>(mNodes.size());
+  header.mEdgeCount = static_cast<uint32_t>(mEdges.size());
+  header.mStringsSize = static_cast<uint32_t>(mStrings.size() + 1);
+  header.mNodesOffset = sizeof(Header);
+  header.mEdgesOffset = header.mNodesOffset + mNodes.size() * sizeof(NodeRecord);
+  header.mStringsOffset = header.mEdgesOffset + mEdges.size() * sizeof(EdgeRecord);
+
+  out.resize(header.mStringsOffset + header.mStringsSize);
+  char* data = out.data();
+
+  std::memcpy(data, &header, sizeof(Header));
+
+  if (!mNodes.empty())
+  {
+    std::memcpy(data + header.mNodesOffset, mNodes.data(), mNodes.size() * sizeof(NodeRecord));
+  }
+
+  EdgeRecord* edges = reinterpret_cast<EdgeRecord*>(data + header.mEdgesOffset);
+  for (size_t i = 0; i < mEdges.size(); ++i)
+  {
+    auto output = uidToIndex.find(mEdges[i].mOutputNode);
+    if (output == uidToIndex.end())
+    {
+      error = "GraphFile: edge connects to unknown node " + std::to_string(mEdges[i].mOutputNode);
+      out.clear();
+      return false;
+    }
+
+    edges[i] = mEdges[i];
+    edges[i].mOutputNode = output->second;
+  }
+
+  // Strings are packed back to back, the table always ends in a '\0' even when empty
+  std::memcpy(data + header.mStringsOffset, mStrings.c_str(), header.mStringsSize);
+
+  return true;
+}
+
+uint32_t GraphFileBuilder::InternString(const char* str, size_t length)
+{
+  std::string key(str, length);
+
+  auto found = mStringOffsets.find(key);
+  if (found != mStringOffsets.end())
+  {
+    return found->second;
+  }
+
+  uint32_t offset = static_cast<uint32_t>(mStrings.size());
+  mStrings.append(key);
+  mStrings.push_back('\0');
+
+  mStringOffsets.emplace(std::move(key), offset);
+  return offset;
+}
+
+bool CAN::WriteGraphFile(const char* path, const std::vector<char>& data)
+{
+  FILE* file = std::fopen(path, "wb");
+  if (!file)
+  {
+    return false;
+  }
+
+  bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+  return std::fclose(file) == 0 && written;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                   Converters
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  // Walks one line of the text format without copying it.  Numbers are
+  // copied into a small stack buffer first since strto* wants a terminator.
+  struct TextCursor
+  {
+    const char* mAt;
+    const char* mEnd;
+
+    // [mAt, delimiter or mEnd), steps past the delimiter
+    const char* Field(char delimiter, size_t& length)
+    {
+      const char* begin = mAt;
+      while (mAt < mEnd && *mAt != delimiter)
+      {
+        ++mAt;
+      }
+
+      length = mAt - begin;
+
+      if (mAt < mEnd)
+      {
+        ++mAt;
+      }
+
+      return begin;
+    }
+
+    bool Number(char delimiter, char* buffer, size_t bufferSize)
+    {
+      size_t length;
+      const char* field = Field(delimiter, length);
+
+      if (length == 0 || length >= bufferSize)
+      {
+        return false;
+      }
+
+      std::memcpy(buffer, field, length);
+      buffer[length] = '\0';
+      return true;
+    }
+
+    bool Unsigned(char delimiter, uint32_t& value)
+    {
+      char buffer[32];
+      char* end;
+
+      if (!Number(delimiter, buffer, sizeof(buffer)))
+      {
+        return false;
+      }
+
+      value = static_cast<uint32_t>(std::strtoul(buffer, &end, 10));
+      return *end == '\0';
+    }
+
+    bool Float(char delimiter, float& value)
+    {
+      char buffer[64];
+      char* end;
+
+      if (!Number(delimiter, buffer, sizeof(buffer)))
+      {
+        return false;
+      }
+
+      value = std::strtof(buffer, &end);
+      return *end == '\0';
+    }
+  };
+}
+
+bool CAN::TextGraphToBinary(const char* text, size_t size, std::vector<char>& out, std::string& error)
+{
+  GraphFileBuilder builder;
+
+  const char* end = text + size;
+  unsigned lineNumber = 0;
+
+  for (const char* line = text; line < end;)
+  {
+    const char* lineEnd = static_cast<const char*>(std::memchr(line, '\n', end - line));
+    lineEnd = lineEnd ? lineEnd : end;
+
+    TextCursor cursor{ line, lineEnd };
+    line = lineEnd + 1;
+    ++lineNumber;
+
+    if (cursor.mAt == cursor.mEnd)
+    {
+      continue;
+    }
+
+    size_t typeNameLength;
+    const char* typeName = cursor.Field(':', typeNameLength);
+
+    uint32_t uid;
+    float x, y;
+    if (typeNameLength == 0 || !cursor.Unsigned(':', uid) || !cursor.Float(',', x) || !cursor.Float(':', y))
+    {
+      error = "GraphFile: bad node on line " + std::to_string(lineNumber);
+      return false;
+    }
+
+    // Nodes without user data write nothing here
+    uint64_t userData = 0;
+    size_t userDataLength;
+    const char* userDataText = cursor.Field(':', userDataLength);
+
+    if (userDataLength > 0)
+    {
+      char buffer[32];
+      char* userDataEnd;
+
+      if (userDataLength >= sizeof(buffer))
+      {
+        error = "GraphFile: bad user data on line " + std::to_string(lineNumber);
+        return false;
+      }
+
+      std::memcpy(buffer, userDataText, userDataLength);
+      buffer[userDataLength] = '\0';
+
+      userData = buffer[0] == '-' ? static_cast<uint64_t>(std::strtoll(buffer, &userDataEnd, 10)) : std::strtoull(buffer, &userDataEnd, 10);
+      if (*userDataEnd != '\0')
+      {
+        error = "GraphFile: bad user data on line " + std::to_string(lineNumber);
+        return false;
+      }
+    }
+
+    builder.AddNode(typeName, typeNameLength, uid, x, y, userData);
+
+    while (cursor.mAt < cursor.mEnd)
+    {
+      size_t connectionLength;
+      const char* connection = cursor.Field(';', connectionLength);
+
+      TextCursor fields{ connection, connection + connectionLength };
+
+      uint32_t inputSlot, outputNode, outputSlot;
+      float controlX, controlY;
+      if (!fields.Unsigned(',', inputSlot) || !fields.Unsigned(',', outputNode) || !fields.Unsigned(',', outputSlot) ||
+          !fields.Float(',', controlX) || !fields.Float(',', controlY))
+      {
+        error = "GraphFile: bad connection on line " + std::to_string(lineNumber);
+        return false;
+      }
+
+      builder.AddEdge(inputSlot, outputNode, outputSlot, controlX, controlY);
+    }
+  }
+
+  return builder.Write(out, error);
+}
+
+void CAN::BinaryGraphToText(const GraphFileView& view, std::string& out)
+{
+  const NodeRecord* nodes = view.GetNodes();
+  const EdgeRecord* edges = view.GetEdges();
+
+  out.clear();
+
+  // Same spelling as the editor's Serialize, floats go through %f like std::to_string
+  char buffer[128];
+
+  for (uint32_t i = 0; i < view.GetNodeCount(); ++i)
+  {
+    const NodeRecord& node = nodes[i];
+
+    out += view.GetString(node.mTypeName);
+    std::snprintf(buffer, sizeof(buffer), ":%u:%f,%f:", node.mUID, node.mX, node.mY);
+    out += buffer;
+
+    // No way to tell "no user data" from 0 here, both read back as 0
+    if (node.mUserData != 0)
+    {
+      out += std::to_string(node.mUserData);
+    }
+
+    out += ':';
+
+    for (uint32_t e = 0; e < node.mEdgeCount; ++e)
+    {
+      const EdgeRecord& edge = edges[node.mFirstEdge + e];
+
+      std::snprintf(buffer, sizeof(buffer), "%s%u,%u,%u,%f,%f", e == 0 ? "" : ";", edge.mInputSlot, nodes[edge.mOutputNode].mUID, edge.mOutputSlot, edge.mControlX, edge.mControlY);
+      out += buffer;
+    }
+
+    out += '\n';
+  }
+}
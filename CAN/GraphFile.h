@@ -0,0 +1,158 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                   Graph File
+  ///////////////////////////////////////////////////////////////////////////////
+  // Binary graph format.  A header followed by three tables, every record has
+  // a fixed width and everything refers to everything else by index or byte
+  // offset, never by pointer, so a file can be mapped and read in place.
+  //
+  //   Header
+  //   NodeRecord[mNodeCount]
+  //   EdgeRecord[mEdgeCount]  grouped by input node, see NodeRecord::mFirstEdge
+  //   char[mStringsSize]      null terminated type names
+  //
+  // Little endian only.  Bump Version whenever a record changes.
+  //
+  // The text format the editor writes (Type:UID:x,y:UserData:in,UID,out,cx,cy;...)
+  // is still around for diffing and pasting, TextGraphToBinary and
+  // BinaryGraphToText convert between the two.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  namespace GraphFile
+  {
+    constexpr char Magic[4] = { 'C', 'A', 'N', 'G' };
+    constexpr uint32_t Version = 1;
+
+    struct Header
+    {
+      char mMagic[4];
+      uint32_t mVersion;
+
+      uint32_t mNodeCount;
+      uint32_t mEdgeCount;
+      uint32_t mStringsSize;
+      uint32_t mPadding;
+
+      // Byte offsets from the start of the file
+      uint64_t mNodesOffset;
+      uint64_t mEdgesOffset;
+      uint64_t mStringsOffset;
+    };
+
+    struct NodeRecord
+    {
+      uint32_t mUID;
+      uint32_t mTypeName; // Offset into the string table
+      float mX;
+      float mY;
+      uint64_t mUserData;
+
+      // This node's input connections are edges [mFirstEdge, mFirstEdge + mEdgeCount)
+      uint32_t mFirstEdge;
+      uint32_t mEdgeCount;
+    };
+
+    struct EdgeRecord
+    {
+      uint32_t mInputNode;  // Node index, not UID
+      uint32_t mInputSlot;
+      uint32_t mOutputNode; // Node index, not UID
+      uint32_t mOutputSlot;
+      float mControlX;
+      float mControlY;
+    };
+
+    static_assert(sizeof(Header) == 48, "GraphFile::Header layout changed, bump Version");
+    static_assert(sizeof(NodeRecord) == 32, "GraphFile::NodeRecord layout changed, bump Version");
+    static_assert(sizeof(EdgeRecord) == 24, "GraphFile::EdgeRecord layout changed, bump Version");
+  }
+
+  // Read only view over a graph file somebody else owns the memory for.  Open
+  // checks every offset and index once, and that no two nodes share a UID, so
+  // readers can walk the records without bounds checks.
+  class GraphFileView
+  {
+  public:
+    bool Open(const void* data, size_t size);
+
+    uint32_t GetNodeCount() const;
+    uint32_t GetEdgeCount() const;
+
+    const GraphFile::NodeRecord* GetNodes() const;
+    const GraphFile::EdgeRecord* GetEdges() const;
+    const char* GetString(uint32_t offset) const;
+
+    const std::string& GetError() const;
+
+  private:
+    bool Fail(const char* error);
+
+    const char* mData = nullptr;
+    const GraphFile::Header* mHeader = nullptr;
+    std::string mError;
+  };
+
+  // Maps a graph file read only for as long as it's alive
+  class MappedGraphFile
+  {
+  public:
+    MappedGraphFile() = default;
+    MappedGraphFile(const MappedGraphFile&) = delete;
+    MappedGraphFile& operator=(const MappedGraphFile&) = delete;
+    ~MappedGraphFile();
+
+    bool Open(const char* path);
+    void Close();
+
+    const GraphFileView& GetView() const;
+    const std::string& GetError() const;
+
+  private:
+    const void* mData = nullptr;
+    size_t mSize = 0;
+
+#ifdef _WIN32
+    void* mFile = nullptr;
+    void* mMapping = nullptr;
+#endif
+
+    GraphFileView mView;
+    std::string mError;
+  };
+
+  // Collects nodes and edges and lays them out as a graph file.  Edges belong
+  // to the node added most recently and name their output node by UID, UIDs
+  // are turned into indices in Write.
+  class GraphFileBuilder
+  {
+  public:
+    void AddNode(const char* typeName, size_t typeNameLength, uint32_t uid, float x, float y, uint64_t userData);
+    void AddEdge(uint32_t inputSlot, uint32_t outputNodeUID, uint32_t outputSlot, float controlX, float controlY);
+
+    // Fails if two nodes share a UID or an edge names a UID that was never added
+    bool Write(std::vector<char>& out, std::string& error) const;
+
+  private:
+    uint32_t InternString(const char* str, size_t length);
+
+    std::vector<GraphFile::NodeRecord> mNodes;
+    std::vector<GraphFile::EdgeRecord> mEdges; // mOutputNode holds the UID until Write
+
+    std::string mStrings;
+    std::unordered_map<std::string, uint32_t> mStringOffsets;
+  };
+
+  bool WriteGraphFile(const char* path, const std::vector<char>& data);
+
+  bool TextGraphToBinary(const char* text, size_t size, std::vector<char>& out, std::string& error);
+  void BinaryGraphToText(const GraphFileView& view, std::string& out);
+}
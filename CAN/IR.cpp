@@ -0,0 +1,258 @@
+﻿#include "IR.h"
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                   IR Builder
+///////////////////////////////////////////////////////////////////////////////
+
+IRBuilder::IRBuilder(RuntimeManager* runtime) : mManager(runtime) {}
+
+bool IRBuilder::Lower(const std::vector<NodeHandle>& finals, IRProgram& program, std::string& error)
+{
+  if (!mOwnEdges.Build(mManager, finals))
+  {
+    program = IRProgram();
+    error = "IR: graph contains a cycle";
+    return false;
+  }
+
+  return Lower(mOwnEdges, program, error);
+}
+
+bool IRBuilder::Lower(const NodeGraph& graph, IRProgram& program, std::string& error)
+{
+  return Lower(graph.mFinals, program, error);
+}
+
+bool IRBuilder::Lower(const NodeForest& forest, IRProgram& program, std::string& error)
+{
+  if (!forest.mError.empty())
+  {
+    error = forest.mError;
+    return false;
+  }
+
+  if (forest.mEdges.GetNodeCount() == 0)
+  {
+    return Lower(forest.mRoots, program, error);
+  }
+
+  return Lower(forest.mEdges, program, error);
+}
+
+bool IRBuilder::Lower(const EdgeTable& edges, IRProgram& program, std::string& error)
+{
+  program = IRProgram();
+  mProgram = &program;
+  mEdges = &edges;
+
+  mValues.assign(edges.GetOutputCount(), NoValue);
+  mVariables.clear();
+
+  program.mInstructions.reserve(edges.GetNodeCount());
+
+  for (uint32_t node = 0; node < edges.GetNodeCount(); ++node)
+  {
+    Node* n = edges.GetNode(node);
+
+    for (const EdgeTable::Edge& input : edges.GetInputs(node))
+    {
+      if (input.mNode == EdgeTable::NoNode)
+      {
+        error = "IR: " + mManager->GetNodeTypeName(n->GetTypeGUID()) + " has an unconnected input";
+        program = IRProgram();
+        mProgram = nullptr;
+        return false;
+      }
+    }
+
+    mNode = node;
+    mSource = edges.GetHandle(node);
+    mFlags = mManager->IsPure(n->GetTypeGUID()) ? 0 : IRSideEffects;
+
+    if (!n->ToIR(*this))
+    {
+      error = "IR: " + mManager->GetNodeTypeName(n->GetTypeGUID()) + " can't be lowered";
+      program = IRProgram();
+      mProgram = nullptr;
+      return false;
+    }
+  }
+
+  mProgram = nullptr;
+  return true;
+}
+
+ValueId IRBuilder::Emit(IROp op, Slot* result, ValueId a, ValueId b, int immediate)
+{
+  ValueId value = ValueId(mProgram->mInstructions.size());
+
+  IRInstruction instruction;
+  instruction.mOp = op;
+  instruction.mFlags = mFlags;
+  instruction.mOperandCount = uint8_t((a != NoValue) + (b != NoValue));
+  instruction.mType = result ? result->GetTypeGUID() : 0;
+  instruction.mOperands[0] = a;
+  instruction.mOperands[1] = b;
+  instruction.mImmediate = immediate;
+  instruction.mSource = mSource;
+
+  mProgram->mInstructions.push_back(instruction);
+
+  if (op == IROp::Input && uint32_t(immediate) >= mProgram->mInputCount)
+  {
+    mProgram->mInputCount = uint32_t(immediate) + 1;
+  }
+  else if (op == IROp::Output && uint32_t(immediate) >= mProgram->mOutputCount)
+  {
+    mProgram->mOutputCount = uint32_t(immediate) + 1;
+  }
+
+  if (result)
+  {
+    Bind(result, value);
+  }
+
+  return value;
+}
+
+void IRBuilder::Bind(Slot* output, ValueId value)
+{
+  SlotRange outputs = mEdges->GetNode(mNode)->GetOutputSlots();
+
+  uint32_t slot = 0;
+  while (outputs[slot] != output)
+  {
+    ++slot;
+  }
+
+  mValues[mEdges->GetOutputIndex(mNode, slot)] = value;
+}
+
+ValueId IRBuilder::Read(Slot* input) const
+{
+  SlotRange inputs = mEdges->GetNode(mNode)->GetInputSlots();
+
+  uint32_t slot = 0;
+  while (inputs[slot] != input)
+  {
+    ++slot;
+  }
+
+  const EdgeTable::Edge& producer = mEdges->GetInputs(mNode)[slot];
+  return mValues[mEdges->GetOutputIndex(producer.mNode, producer.mSlot)];
+}
+
+void IRBuilder::BindVariable(Node* store, ValueId value) { mVariables[store] = value; }
+
+bool IRBuilder::ReadVariable(Node* store, ValueId& value) const
+{
+  auto itr = mVariables.find(store);
+  if (itr == mVariables.end())
+  {
+    return false;
+  }
+
+  value = itr->second;
+  return true;
+}
+
+RuntimeManager* IRBuilder::GetRuntime() const { return mManager; }
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                               IR Interpreter
+///////////////////////////////////////////////////////////////////////////////
+
+void IRInterpreter::Execute(const IRProgram& program, const int* inputs, int* outputs)
+{
+  mValues.resize(program.mInstructions.size());
+  int* v = mValues.data();
+
+  for (size_t i = 0; i < program.mInstructions.size(); ++i)
+  {
+    const IRInstruction& instruction = program.mInstructions[i];
+
+    switch (instruction.mOp)
+    {
+    case IROp::Constant:
+      v[i] = instruction.mImmediate;
+      break;
+    case IROp::Input:
+      v[i] = inputs[instruction.mImmediate];
+      break;
+    case IROp::Add:
+      v[i] = v[instruction.mOperands[0]] + v[instruction.mOperands[1]];
+      break;
+    case IROp::Print:
+      std::cout << v[instruction.mOperands[0]] << std::endl;
+      break;
+    case IROp::Output:
+      outputs[instruction.mImmediate] = v[instruction.mOperands[0]];
+      break;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                             Standard Library
+///////////////////////////////////////////////////////////////////////////////
+
+bool IntegerLiteralNode::ToIR(IRBuilder& builder)
+{
+  builder.Emit(IROp::Constant, &mOut, NoValue, NoValue, mOut.mValue);
+  return true;
+}
+
+bool IntegerInputNode::ToIR(IRBuilder& builder)
+{
+  if (mIndex < 0)
+  {
+    return false;
+  }
+
+  builder.Emit(IROp::Input, &mOut, NoValue, NoValue, mIndex);
+  return true;
+}
+
+bool IntegerAdditionNode::ToIR(IRBuilder& builder)
+{
+  builder.Emit(IROp::Add, &mOut, builder.Read(&mA), builder.Read(&mB));
+  return true;
+}
+
+bool IntegerPrinterNode::ToIR(IRBuilder& builder)
+{
+  builder.Emit(IROp::Print, nullptr, builder.Read(&mIn));
+  return true;
+}
+
+bool IntegerOutputNode::ToIR(IRBuilder& builder)
+{
+  if (mIndex < 0)
+  {
+    return false;
+  }
+
+  builder.Emit(IROp::Output, nullptr, builder.Read(&mIn), NoValue, mIndex);
+  return true;
+}
+
+// Variables only exist to share a value, in SSA that's just reading the same id
+bool StoreIntegerVariableNode::ToIR(IRBuilder& builder)
+{
+  builder.BindVariable(this, builder.Read(&mIn));
+  return true;
+}
+
+bool LoadIntegerVariableNode::ToIR(IRBuilder& builder)
+{
+  ValueId value;
+  if (!builder.ReadVariable(GetRuntime()->GetWeakRef(mPair), value))
+  {
+    return false;
+  }
+
+  builder.Bind(&mOut, value);
+  return true;
+}
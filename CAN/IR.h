@@ -0,0 +1,126 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                           IR
+  ///////////////////////////////////////////////////////////////////////////////
+  // A flat, typed SSA form of everything a graph's finals reach.  Every
+  // instruction defines at most one value and that value's id is the
+  // instruction's index, operands always come earlier.  A value read in
+  // several places is just the same id, so there's no Store/Load splitting and
+  // nothing to ruin.
+  //
+  // Lowering only reads the graph, it can be redone after every edit.  Nodes
+  // lower themselves through Node::ToIR.  Values take their type from the
+  // output slot's SlotTypeGUID, and nodes not registered as pure get
+  // IRSideEffects so nothing removes or merges them.
+  //
+  // This is the only way from a graph to a backend.  The IR interpreter,
+  // OptimizeIR, BytecodeCompiler and WriteTranslationUnit all take an
+  // IRProgram, and the JIT and batch interpreter take the bytecode.  The
+  // entry points that take a forest just lower it first.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  using ValueId = uint32_t;
+
+  static constexpr ValueId NoValue = ~ValueId(0);
+
+  enum class IROp : uint8_t
+  {
+    Constant, // mImmediate
+    Input,    // host input mImmediate
+    Add,      // operand 0 + operand 1
+    Print,    // print operand 0
+    Output,   // host output mImmediate = operand 0
+  };
+
+  enum IRFlags : uint8_t
+  {
+    IRSideEffects = 1 << 0,
+  };
+
+  struct IRInstruction
+  {
+    IROp mOp;
+    uint8_t mFlags;
+    uint8_t mOperandCount;
+    SlotTypeGUID mType; // 0 if the instruction doesn't define a value
+    ValueId mOperands[2];
+    int mImmediate;
+    NodeHandle mSource; // The node it was lowered from
+  };
+
+  class IRProgram
+  {
+  public:
+    std::vector<IRInstruction> mInstructions;
+    uint32_t mInputCount = 0;
+    uint32_t mOutputCount = 0;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                   IR Builder
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class IRBuilder
+  {
+  public:
+    IRBuilder(RuntimeManager* runtime);
+
+    // Fails on a cycle, an unconnected input or a node without an IR form,
+    // program is left empty then.  Forests use their mEdges if it's built.
+    bool Lower(const std::vector<NodeHandle>& finals, IRProgram& program, std::string& error);
+    bool Lower(const NodeGraph& graph, IRProgram& program, std::string& error);
+    bool Lower(const NodeForest& forest, IRProgram& program, std::string& error);
+    bool Lower(const EdgeTable& edges, IRProgram& program, std::string& error);
+
+    // Helpers for Node::ToIR.  result is the output slot the value comes out
+    // of, nullptr for instructions that don't define one.  Bind and Read only
+    // take the slots of the node being lowered.
+    ValueId Emit(IROp op, Slot* result, ValueId a = NoValue, ValueId b = NoValue, int immediate = 0);
+
+    void Bind(Slot* output, ValueId value);
+    ValueId Read(Slot* input) const;
+
+    void BindVariable(Node* store, ValueId value);
+    bool ReadVariable(Node* store, ValueId& value) const;
+
+    RuntimeManager* GetRuntime() const;
+
+  private:
+    RuntimeManager* mManager;
+    IRProgram* mProgram = nullptr;
+
+    // The node being lowered
+    const EdgeTable* mEdges = nullptr;
+    uint32_t mNode = 0;
+    NodeHandle mSource;
+    uint8_t mFlags = 0;
+
+    EdgeTable mOwnEdges;
+    std::vector<ValueId> mValues; // Per EdgeTable output index
+    std::unordered_map<Node*, ValueId> mVariables;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                               IR Interpreter
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class IRInterpreter
+  {
+  public:
+    // inputs needs program.mInputCount values and outputs program.mOutputCount
+    void Execute(const IRProgram& program, const int* inputs = nullptr, int* outputs = nullptr);
+
+  private:
+    std::vector<int> mValues;
+  };
+}
@@ -0,0 +1,557 @@
+﻿#include "Jit.h"
+
+#include <cstring>
+#include <iostream>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CAN_JIT 1
+#else
+#define CAN_JIT 0
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                            Executable Memory
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+#ifdef _WIN32
+  size_t PageSize()
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+  }
+
+  void* AllocatePages(size_t size)
+  {
+    return VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  }
+
+  bool ProtectPages(void* pages, size_t size, bool executable)
+  {
+    DWORD old;
+    if (!VirtualProtect(pages, size, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old))
+    {
+      return false;
+    }
+
+    return !executable || FlushInstructionCache(GetCurrentProcess(), pages, size);
+  }
+
+  void FreePages(void* pages, size_t size)
+  {
+    VirtualFree(pages, 0, MEM_RELEASE);
+  }
+#else
+  size_t PageSize()
+  {
+    return size_t(sysconf(_SC_PAGESIZE));
+  }
+
+  void* AllocatePages(size_t size)
+  {
+    void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return pages == MAP_FAILED ? nullptr : pages;
+  }
+
+  bool ProtectPages(void* pages, size_t size, bool executable)
+  {
+    return mprotect(pages, size, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) == 0;
+  }
+
+  void FreePages(void* pages, size_t size)
+  {
+    munmap(pages, size);
+  }
+#endif
+}
+
+JitProgram::~JitProgram()
+{
+  Release();
+}
+
+void JitProgram::Execute(const int* inputs, int* outputs)
+{
+  // Nothing to jump to if Compile failed
+  if (!IsValid())
+  {
+    return;
+  }
+
+  reinterpret_cast<Entry>(mPages)(inputs, mFrame.data(), outputs);
+}
+
+bool JitProgram::IsValid() const { return mCodeSize != 0; }
+size_t JitProgram::GetCodeSize() const { return mCodeSize; }
+
+bool JitProgram::Load(const std::vector<uint8_t>& code)
+{
+  mCodeSize = 0;
+
+  if (code.size() > mCapacity)
+  {
+    Release();
+
+    size_t page = PageSize();
+    size_t size = (code.size() + page - 1) / page * page;
+
+    mPages = AllocatePages(size);
+    if (!mPages)
+    {
+      return false;
+    }
+
+    mCapacity = size;
+  }
+  else if (!ProtectPages(mPages, mCapacity, false))
+  {
+    return false;
+  }
+
+  std::memcpy(mPages, code.data(), code.size());
+
+  if (!ProtectPages(mPages, mCapacity, true))
+  {
+    return false;
+  }
+
+  mCodeSize = code.size();
+  return true;
+}
+
+void JitProgram::Release()
+{
+  if (mPages)
+  {
+    FreePages(mPages, mCapacity);
+  }
+
+  mPages = nullptr;
+  mCapacity = 0;
+  mCodeSize = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                    Assembler
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  enum Gpr : uint8_t
+  {
+    Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi,
+    R8, R9, R10, R11, R12, R13, R14, R15
+  };
+
+  // A register, or [mRegister + mOffset] if mInMemory
+  struct Location
+  {
+    bool mInMemory;
+    uint8_t mRegister;
+    int32_t mOffset;
+
+    static Location Reg(uint8_t reg) { return { false, reg, 0 }; }
+    static Location Mem(uint8_t base, int32_t offset) { return { true, base, offset }; }
+
+    bool operator==(const Location& other) const
+    {
+      return mInMemory == other.mInMemory && mRegister == other.mRegister && mOffset == other.mOffset;
+    }
+  };
+
+  // Just the handful of instructions the JIT needs, all 32 bit unless noted
+  class Assembler
+  {
+  public:
+    Assembler(std::vector<uint8_t>& code) : mCode(code) {}
+
+    void Byte(uint8_t value) { mCode.push_back(value); }
+
+    void Dword(uint32_t value)
+    {
+      for (int i = 0; i < 4; ++i)
+      {
+        Byte(uint8_t(value >> (8 * i)));
+      }
+    }
+
+    void Qword(uint64_t value)
+    {
+      Dword(uint32_t(value));
+      Dword(uint32_t(value >> 32));
+    }
+
+    // opcode reg, rm.  Memory operands always use a 32 bit displacement.
+    void Op(uint8_t opcode, uint8_t reg, Location rm, bool wide = false)
+    {
+      uint8_t rex = (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm.mRegister & 8) ? 1 : 0);
+      if (rex)
+      {
+        Byte(0x40 | rex);
+      }
+
+      Byte(opcode);
+
+      if (!rm.mInMemory)
+      {
+        Byte(0xC0 | ((reg & 7) << 3) | (rm.mRegister & 7));
+        return;
+      }
+
+      Byte(0x80 | ((reg & 7) << 3) | (rm.mRegister & 7));
+
+      // rsp and r12 as a base need a SIB byte
+      if ((rm.mRegister & 7) == Rsp)
+      {
+        Byte(0x24);
+      }
+
+      Dword(uint32_t(rm.mOffset));
+    }
+
+    void Push(uint8_t reg)
+    {
+      if (reg & 8)
+      {
+        Byte(0x41);
+      }
+
+      Byte(0x50 | (reg & 7));
+    }
+
+    void Pop(uint8_t reg)
+    {
+      if (reg & 8)
+      {
+        Byte(0x41);
+      }
+
+      Byte(0x58 | (reg & 7));
+    }
+
+    void MovRegRm(uint8_t reg, Location rm)
+    {
+      if (!(rm == Location::Reg(reg)))
+      {
+        Op(0x8B, reg, rm);
+      }
+    }
+
+    void MovRmReg(Location rm, uint8_t reg)
+    {
+      if (!(rm == Location::Reg(reg)))
+      {
+        Op(0x89, reg, rm);
+      }
+    }
+
+    void MovRmImm(Location rm, int32_t value)
+    {
+      Op(0xC7, 0, rm);
+      Dword(uint32_t(value));
+    }
+
+    void AddRegRm(uint8_t reg, Location rm)
+    {
+      Op(0x03, reg, rm);
+    }
+
+    // 64 bit
+    void Mov64(uint8_t dst, uint8_t src) { Op(0x89, src, Location::Reg(dst), true); }
+    void Load64(uint8_t dst, Location src) { Op(0x8B, dst, src, true); }
+    void Store64(Location dst, uint8_t src) { Op(0x89, src, dst, true); }
+    void SubRsp(int32_t value) { Op(0x81, 5, Location::Reg(Rsp), true); Dword(uint32_t(value)); }
+    void AddRsp(int32_t value) { Op(0x81, 0, Location::Reg(Rsp), true); Dword(uint32_t(value)); }
+
+    // mov rax, target; call rax
+    void Call(const void* target)
+    {
+      Byte(0x48);
+      Byte(0xB8);
+      Qword(uint64_t(reinterpret_cast<uintptr_t>(target)));
+      Byte(0xFF);
+      Byte(0xD0);
+    }
+
+    void Ret() { Byte(0xC3); }
+
+  private:
+    std::vector<uint8_t>& mCode;
+  };
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                           Register Allocator
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+#ifdef _WIN32
+  const uint8_t InputsArgument = Rcx;
+  const uint8_t FrameArgument = Rdx;
+  const uint8_t OutputsArgument = R8;
+  const uint8_t PrintArgument = Rcx;
+  const int32_t ShadowSpace = 32;
+#else
+  const uint8_t InputsArgument = Rdi;
+  const uint8_t FrameArgument = Rsi;
+  const uint8_t OutputsArgument = Rdx;
+  const uint8_t PrintArgument = Rdi;
+  const int32_t ShadowSpace = 0;
+#endif
+
+  // Callee saved on both ABIs, so Print doesn't need anything spilled
+  const uint8_t InputsRegister = R15;
+  const uint8_t FrameRegister = R14;
+  const uint8_t TemporaryRegisters[] = { Rbx, Rbp, R12, R13 };
+  const uint8_t SavedRegisters[] = { Rbx, Rbp, R12, R13, R14, R15 };
+
+  // Outputs are rare enough to keep their pointer in the stack's alignment
+  // padding rather than give up a register for it
+  const Location OutputsSlot = Location::Mem(Rsp, ShadowSpace);
+
+  class RegisterAllocator
+  {
+  public:
+    RegisterAllocator()
+    {
+      for (size_t i = sizeof(TemporaryRegisters); i-- > 0;)
+      {
+        mFreeRegisters.push_back(TemporaryRegisters[i]);
+      }
+    }
+
+    Location AllocateTemporary()
+    {
+      if (!mFreeRegisters.empty())
+      {
+        uint8_t reg = mFreeRegisters.back();
+        mFreeRegisters.pop_back();
+        return Location::Reg(reg);
+      }
+
+      return AllocateSlot();
+    }
+
+    Location AllocateSlot()
+    {
+      if (!mFreeSlots.empty())
+      {
+        Location slot = mFreeSlots.back();
+        mFreeSlots.pop_back();
+        return slot;
+      }
+
+      return Location::Mem(FrameRegister, int32_t(4 * mSlotCount++));
+    }
+
+    void Release(Location location)
+    {
+      if (location.mInMemory)
+      {
+        mFreeSlots.push_back(location);
+      }
+      else
+      {
+        mFreeRegisters.push_back(location.mRegister);
+      }
+    }
+
+    size_t GetSlotCount() const { return mSlotCount; }
+
+  private:
+    std::vector<uint8_t> mFreeRegisters;
+    std::vector<Location> mFreeSlots;
+    size_t mSlotCount = 0;
+  };
+
+  void JitPrint(int value)
+  {
+    std::cout << value << std::endl;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 JIT Compiler
+///////////////////////////////////////////////////////////////////////////////
+
+bool JitCompiler::Compile(const BytecodeProgram& bytecode, JitProgram& program)
+{
+  program.mCodeSize = 0;
+
+#if !CAN_JIT
+  return false;
+#else
+  const std::vector<Instruction>& instructions = bytecode.mInstructions;
+  const size_t none = size_t(-1);
+
+  // Last instruction reading each register
+  std::vector<size_t> lastRead(bytecode.mRegisterCount, none);
+
+  for (size_t i = 0; i < instructions.size(); ++i)
+  {
+    const Instruction& instruction = instructions[i];
+
+    switch (instruction.mOpCode)
+    {
+    case OpCode::LoadConstant:
+    case OpCode::LoadInput:
+      break;
+    case OpCode::Add:
+      lastRead[instruction.mA] = i;
+      lastRead[instruction.mB] = i;
+      break;
+    case OpCode::Print:
+    case OpCode::Output:
+      lastRead[instruction.mA] = i;
+      break;
+    default:
+      return false;
+    }
+  }
+
+  // Where every register lives
+  std::vector<Location> locations(bytecode.mRegisterCount);
+  std::vector<bool> released(bytecode.mRegisterCount, false);
+  RegisterAllocator allocator;
+
+  auto release = [&](Register reg, size_t i)
+  {
+    if (lastRead[reg] == i && !released[reg])
+    {
+      allocator.Release(locations[reg]);
+      released[reg] = true; // Only once when both operands are the same
+    }
+  };
+
+  for (size_t i = 0; i < instructions.size(); ++i)
+  {
+    const Instruction& instruction = instructions[i];
+
+    // Operands go back first so the result can take their place, the code
+    // below reads operands before it writes the result
+    switch (instruction.mOpCode)
+    {
+    case OpCode::Add:
+      release(instruction.mA, i);
+      release(instruction.mB, i);
+      break;
+    case OpCode::Print:
+    case OpCode::Output:
+      release(instruction.mA, i);
+      break;
+    default:
+      break;
+    }
+
+    switch (instruction.mOpCode)
+    {
+    case OpCode::LoadConstant:
+    case OpCode::LoadInput:
+    case OpCode::Add:
+      locations[instruction.mDst] = allocator.AllocateTemporary();
+      release(instruction.mDst, none);
+      break;
+    default:
+      break;
+    }
+  }
+
+  mCode.clear();
+  Assembler a(mCode);
+
+  // Six pushes leave rsp 8 off of 16 byte alignment for calls
+  int32_t stack = ShadowSpace + 8;
+
+  for (uint8_t reg : SavedRegisters)
+  {
+    a.Push(reg);
+  }
+
+  a.SubRsp(stack);
+  a.Mov64(InputsRegister, InputsArgument);
+  a.Mov64(FrameRegister, FrameArgument);
+  a.Store64(OutputsSlot, OutputsArgument);
+
+  // Operands are only looked up where they're registers, LoadInput's mA is
+  // an input index and Print has no mDst
+  for (const Instruction& instruction : instructions)
+  {
+    switch (instruction.mOpCode)
+    {
+    case OpCode::LoadConstant:
+      a.MovRmImm(locations[instruction.mDst], instruction.mImmediate);
+      break;
+    case OpCode::LoadInput:
+      {
+        Location dst = locations[instruction.mDst];
+        Location input = Location::Mem(InputsRegister, int32_t(4 * instruction.mA));
+        uint8_t reg = dst.mInMemory ? uint8_t(Rax) : dst.mRegister;
+
+        a.MovRegRm(reg, input);
+        a.MovRmReg(dst, reg);
+      }
+      break;
+    case OpCode::Add:
+      {
+        Location dst = locations[instruction.mDst];
+        Location lhs = locations[instruction.mA];
+        Location rhs = locations[instruction.mB];
+
+        if (!dst.mInMemory && dst == rhs)
+        {
+          a.AddRegRm(dst.mRegister, lhs);
+        }
+        else
+        {
+          uint8_t reg = dst.mInMemory ? uint8_t(Rax) : dst.mRegister;
+
+          a.MovRegRm(reg, lhs);
+          a.AddRegRm(reg, rhs);
+          a.MovRmReg(dst, reg);
+        }
+      }
+      break;
+    case OpCode::Print:
+      a.MovRegRm(PrintArgument, locations[instruction.mA]);
+      a.Call(reinterpret_cast<const void*>(&JitPrint));
+      break;
+    case OpCode::Output:
+      {
+        Location value = locations[instruction.mA];
+        uint8_t reg = value.mInMemory ? uint8_t(Rcx) : value.mRegister;
+
+        a.Load64(Rax, OutputsSlot);
+        a.MovRegRm(reg, value);
+        a.MovRmReg(Location::Mem(Rax, int32_t(4 * instruction.mImmediate)), reg);
+      }
+      break;
+    }
+  }
+
+  a.AddRsp(stack);
+
+  for (size_t i = sizeof(SavedRegisters); i-- > 0;)
+  {
+    a.Pop(SavedRegisters[i]);
+  }
+
+  a.Ret();
+
+  program.mFrame.assign(allocator.GetSlotCount(), 0);
+  return program.Load(mCode);
+#endif
+}
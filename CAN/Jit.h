@@ -0,0 +1,74 @@
+﻿#pragma once
+
+#include "Bytecode.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                          JIT
+  ///////////////////////////////////////////////////////////////////////////////
+  // Turns a BytecodeProgram straight into x86-64 machine code, no compiler and
+  // no dependencies, fast enough to redo on every edit.
+  //
+  // Registers are handed out in one pass over the program.  Temporaries get
+  // one of a fixed set of callee saved registers while any are free and spill
+  // to a frame slot otherwise, either is freed again after its last read.
+  // Values Forestify split into a Store and Loads are one register by now, the
+  // IR shares them.  The frame is owned by the JitProgram rather than on the
+  // stack so big programs can't overflow it.  Prints call back into C++ so
+  // they come out the same as the interpreter's.
+  //
+  // Compile fails on anything but x86-64 or on an opcode it doesn't know, run
+  // the program through BytecodeInterpreter then.  Forests that don't lower to
+  // IR never get this far, those go through Execute.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  // Code lives in its own pages, writable while it's being copied in and only
+  // executable after that
+  class JitProgram
+  {
+  public:
+    JitProgram() = default;
+    ~JitProgram();
+
+    JitProgram(const JitProgram&) = delete;
+    JitProgram& operator=(const JitProgram&) = delete;
+
+    // inputs needs mInputCount values and outputs mOutputCount, same as
+    // BytecodeInterpreter.  Not reentrant, every call shares the frame.  Does
+    // nothing unless IsValid.
+    void Execute(const int* inputs = nullptr, int* outputs = nullptr);
+
+    bool IsValid() const;
+    size_t GetCodeSize() const;
+
+  private:
+    using Entry = void(*)(const int* inputs, int* frame, int* outputs);
+
+    bool Load(const std::vector<uint8_t>& code);
+    void Release();
+
+    void* mPages = nullptr;
+    size_t mCapacity = 0;
+    size_t mCodeSize = 0;
+
+    std::vector<int> mFrame;
+
+    friend class JitCompiler;
+  };
+
+  class JitCompiler
+  {
+  public:
+    // Leaves program invalid and returns false if it couldn't be compiled.
+    // Reuses program's pages when the new code fits.
+    bool Compile(const BytecodeProgram& bytecode, JitProgram& program);
+
+  private:
+    std::vector<uint8_t> mCode;
+  };
+}
@@ -0,0 +1,295 @@
+﻿#include "Jobs.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                  Thread Pool
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  // Lets Submit find the calling worker's own deque
+  thread_local ThreadPool* tPool = nullptr;
+  thread_local unsigned tWorkerIndex = 0;
+}
+
+ThreadPool::ThreadPool(unsigned workerCount)
+{
+  workerCount = std::max(1u, workerCount);
+
+  for (unsigned i = 0; i < workerCount; ++i)
+  {
+    mWorkers.push_back(std::make_unique<Worker>());
+  }
+
+  for (unsigned i = 0; i < workerCount; ++i)
+  {
+    mThreads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mSleepMutex);
+    mStopping = true;
+  }
+
+  mWake.notify_all();
+
+  for (std::thread& thread : mThreads)
+  {
+    thread.join();
+  }
+}
+
+void ThreadPool::Submit(Job job)
+{
+  unsigned index = tPool == this ? tWorkerIndex : mNextWorker++ % mWorkers.size();
+
+  // Counted before it's pushed, otherwise a worker could pop it and take one
+  // off mPending before it was ever added.  A worker that wakes in between
+  // just finds nothing and goes round again.
+  {
+    std::lock_guard<std::mutex> lock(mSleepMutex);
+    ++mPending;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mWorkers[index]->mMutex);
+    mWorkers[index]->mJobs.push_back(std::move(job));
+  }
+
+  mWake.notify_one();
+}
+
+unsigned ThreadPool::GetWorkerCount() const { return static_cast<unsigned>(mWorkers.size()); }
+
+void ThreadPool::WorkerLoop(unsigned index)
+{
+  tPool = this;
+  tWorkerIndex = index;
+
+  for (;;)
+  {
+    Job job;
+    if (TryPop(index, job))
+    {
+      {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        --mPending;
+      }
+
+      job();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mSleepMutex);
+    mWake.wait(lock, [this]() { return mStopping || mPending > 0; });
+
+    if (mStopping && mPending == 0)
+    {
+      return;
+    }
+  }
+}
+
+bool ThreadPool::TryPop(unsigned index, Job& job)
+{
+  // Own work first, newest first since it's most likely still in cache
+  {
+    Worker& own = *mWorkers[index];
+    std::lock_guard<std::mutex> lock(own.mMutex);
+
+    if (!own.mJobs.empty())
+    {
+      job = std::move(own.mJobs.back());
+      own.mJobs.pop_back();
+      return true;
+    }
+  }
+
+  // Then steal the oldest job from somebody else
+  for (size_t i = 1; i < mWorkers.size(); ++i)
+  {
+    Worker& victim = *mWorkers[(index + i) % mWorkers.size()];
+    std::lock_guard<std::mutex> lock(victim.mMutex);
+
+    if (!victim.mJobs.empty())
+    {
+      job = std::move(victim.mJobs.front());
+      victim.mJobs.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                             Forest Scheduler
+///////////////////////////////////////////////////////////////////////////////
+
+struct ForestScheduler::Run
+{
+  const ForestScheduler* mScheduler;
+  JobSystem* mJobs;
+
+  std::unique_ptr<std::atomic<uint32_t>[]> mWaitingOn;
+
+  std::mutex mDoneMutex;
+  std::condition_variable mDone;
+  size_t mRemaining;
+};
+
+ForestScheduler::ForestScheduler(const NodeForest& forest)
+  : mManager(forest.GetRuntime()), mRoots(forest.mRoots), mSizes(forest.mRoots.size(), 0), mDependents(forest.mRoots.size()), mDependencyCounts(forest.mRoots.size(), 0)
+{
+  std::unordered_map<NodeHandle, uint32_t, NodeHandleHasher> rootIndices;
+  for (uint32_t i = 0; i < mRoots.size(); ++i)
+  {
+    rootIndices[mRoots[i]] = i;
+  }
+
+  // Last root that was recorded as depending on root j, so a root reading the
+  // same Store twice only counts it once
+  std::vector<uint32_t> lastDependent(mRoots.size(), ~0u);
+
+  std::vector<Node*> stack;
+  for (uint32_t i = 0; i < mRoots.size(); ++i)
+  {
+    stack.push_back(mManager->GetWeakRef(mRoots[i]));
+
+    while (!stack.empty())
+    {
+      Node* node = stack.back();
+      stack.pop_back();
+      ++mSizes[i];
+
+      if (node->GetTypeGUID() == LoadIntegerVariableNode::TypeGUID)
+      {
+        auto store = rootIndices.find(static_cast<LoadIntegerVariableNode*>(node)->GetPair());
+
+        if (store != rootIndices.end() && store->second != i && lastDependent[store->second] != i)
+        {
+          lastDependent[store->second] = i;
+          mDependents[store->second].push_back(i);
+          ++mDependencyCounts[i];
+        }
+      }
+
+      for (Slot* input : node->GetInputSlots())
+      {
+        if (!input->mConnectedTo.empty())
+        {
+          stack.push_back(input->mConnectedTo[0]->GetParent());
+        }
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < mRoots.size(); ++i)
+  {
+    if (mDependencyCounts[i] == 0)
+    {
+      mReady.push_back(i);
+    }
+  }
+}
+
+void ForestScheduler::Execute()
+{
+  JobSystem* jobs = mManager->GetJobSystem();
+
+  if (!jobs)
+  {
+    // mRoots is already in an order that respects every dependency
+    for (NodeHandle root : mRoots)
+    {
+      mManager->GetWeakRef(root)->Run();
+    }
+
+    return;
+  }
+
+  if (mRoots.empty())
+  {
+    return;
+  }
+
+  std::shared_ptr<Run> run = std::make_shared<Run>();
+  run->mScheduler = this;
+  run->mJobs = jobs;
+  run->mRemaining = mRoots.size();
+  run->mWaitingOn.reset(new std::atomic<uint32_t>[mRoots.size()]);
+
+  for (size_t i = 0; i < mRoots.size(); ++i)
+  {
+    run->mWaitingOn[i] = mDependencyCounts[i];
+  }
+
+  SubmitRoots(run, mReady.data(), mReady.size());
+
+  std::unique_lock<std::mutex> lock(run->mDoneMutex);
+  run->mDone.wait(lock, [&run]() { return run->mRemaining == 0; });
+}
+
+void ForestScheduler::SubmitRoots(const std::shared_ptr<Run>& run, const uint32_t* roots, size_t count)
+{
+  const ForestScheduler* scheduler = run->mScheduler;
+
+  size_t first = 0;
+  uint32_t nodes = 0;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    nodes += scheduler->mSizes[roots[i]];
+
+    if (nodes >= JobNodes || i + 1 == count)
+    {
+      std::vector<uint32_t> job(roots + first, roots + i + 1);
+      run->mJobs->Submit([run, job]() { RunRoots(run, job); });
+
+      first = i + 1;
+      nodes = 0;
+    }
+  }
+}
+
+void ForestScheduler::RunRoots(const std::shared_ptr<Run>& run, const std::vector<uint32_t>& roots)
+{
+  const ForestScheduler* scheduler = run->mScheduler;
+
+  // Roots this job made ready, handed out together once it's done
+  std::vector<uint32_t> ready;
+
+  for (uint32_t root : roots)
+  {
+    scheduler->mManager->GetWeakRef(scheduler->mRoots[root])->Run();
+
+    for (uint32_t dependent : scheduler->mDependents[root])
+    {
+      if (--run->mWaitingOn[dependent] == 0)
+      {
+        ready.push_back(dependent);
+      }
+    }
+  }
+
+  if (!ready.empty())
+  {
+    SubmitRoots(run, ready.data(), ready.size());
+  }
+
+  // Nothing may touch the scheduler after this, Execute is free to return
+  std::lock_guard<std::mutex> lock(run->mDoneMutex);
+  run->mRemaining -= roots.size();
+
+  if (run->mRemaining == 0)
+  {
+    run->mDone.notify_all();
+  }
+}
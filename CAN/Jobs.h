@@ -0,0 +1,117 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                   Job System
+  ///////////////////////////////////////////////////////////////////////////////
+  // The threading half of the client callbacks, registered next to the
+  // AllocatorFactory with RuntimeManager::RegisterJobSystem.  CAN only ever
+  // hands over small jobs and waits for them itself, where they run is up to
+  // the host.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class JobSystem
+  {
+  public:
+    using Job = std::function<void()>;
+
+    virtual ~JobSystem() = default;
+
+    virtual void Submit(Job job) = 0;
+    virtual unsigned GetWorkerCount() const = 0;
+  };
+
+  // Default JobSystem for hosts that don't have one.  Every worker owns a
+  // deque, jobs submitted from a worker go on its own deque and are popped
+  // LIFO, idle workers steal FIFO from the others.
+  class ThreadPool final : public JobSystem
+  {
+  public:
+    ThreadPool(unsigned workerCount = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    void Submit(Job job) override;
+    unsigned GetWorkerCount() const override;
+
+  private:
+    struct Worker
+    {
+      std::mutex mMutex;
+      std::deque<Job> mJobs;
+    };
+
+    void WorkerLoop(unsigned index);
+    bool TryPop(unsigned index, Job& job);
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::vector<std::thread> mThreads;
+
+    std::mutex mSleepMutex;
+    std::condition_variable mWake;
+    size_t mPending = 0; // Guarded by mSleepMutex
+    bool mStopping = false;
+
+    std::atomic<unsigned> mNextWorker{ 0 };
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                             Forest Scheduler
+  ///////////////////////////////////////////////////////////////////////////////
+  // Runs a forest's roots on the runtime's JobSystem.  After Forestify no two
+  // roots share a node, so the only ordering left is that a root reading a Load
+  // has to wait for the root holding its Store.  Roots are scheduled as soon as
+  // every Store they read has finished, everything else runs side by side.
+  // Shared subtrees are already their own Store roots so they get scheduled
+  // independently too.
+  //
+  // Ready roots are handed out in jobs of around JobNodes nodes, so a forest
+  // of thousands of tiny roots doesn't pay for a job each.  A root is never
+  // split, Execute pulls a node's whole subtree through Run and nothing records
+  // what already ran.
+  //
+  // The dependency graph is built once in the constructor, keep the scheduler
+  // around to run the same forest repeatedly.  Print order between independent
+  // roots is whatever the threads make it.  Don't call Execute from inside a
+  // job.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class ForestScheduler
+  {
+  public:
+    ForestScheduler(const NodeForest& forest);
+
+    // Blocks until every root has run.  Runs on the calling thread if the
+    // runtime has no JobSystem.
+    void Execute();
+
+    static constexpr uint32_t JobNodes = 1024;
+
+  private:
+    struct Run;
+
+    // Roots go out in jobs of around JobNodes nodes each
+    static void SubmitRoots(const std::shared_ptr<Run>& run, const uint32_t* roots, size_t count);
+    static void RunRoots(const std::shared_ptr<Run>& run, const std::vector<uint32_t>& roots);
+
+    RuntimeManager* mManager;
+    std::vector<NodeHandle> mRoots;
+    std::vector<uint32_t> mSizes; // Nodes under each root
+    std::vector<uint32_t> mReady; // Roots that don't wait on any other
+
+    // Roots waiting on root i, and how many roots root i waits on
+    std::vector<std::vector<uint32_t>> mDependents;
+    std::vector<uint32_t> mDependencyCounts;
+  };
+}
@@ -1,64 +1,65 @@
 #include "CAN.h"
+#include "Bytecode.h"
+#include "Jobs.h"
+#include "Optimize.h"
+#include "PoolAllocator.h"
 
 using namespace CAN;
 
-///////////////////////////////////////////////////////////////////////////////
-//                                                                Dumb API Impl
-///////////////////////////////////////////////////////////////////////////////
-
-class DumbAllocator final : public Allocator
-{
-public:
-  DumbAllocator(int size) : mSize(size) {}
-
-  AllocatorFactory::RelativeBlockHandle Allocate() override { return reinterpret_cast<uint64_t>(new char[mSize]); }
-  void Free(AllocatorFactory::RelativeBlockHandle handle) override { delete[] reinterpret_cast<char*>(handle); }
-
-  void* GetWeakRef(AllocatorFactory::RelativeBlockHandle handle) override { return reinterpret_cast<char*>(handle); }
-
-  AllocatorFactory::AllocatorHandle GetAllocatorHandle() override { return reinterpret_cast<uint64_t>(this); }
-
-private:
-  int mSize;
-};
-
-class DumbAllocatorFactory : public AllocatorFactory
-{
-public:
-  AllocatorHandle MakeAllocator(size_t size, NodeTypeGUID uid) override { return reinterpret_cast<uint64_t>(new DumbAllocator(size)); }
-  void FreeAllocator(Allocator* alloc) override { return delete reinterpret_cast<DumbAllocator*>(alloc); }
-
-  Allocator* LookupAllocator(AllocatorHandle handle) { return reinterpret_cast<Allocator*>(handle); }
-};
-
 void MakeTestGraph()
 {
   RuntimeManager runtime;
-  runtime.RegisterAllocatorFactory(new DumbAllocatorFactory());
+  PoolAllocatorFactory factory;
+  runtime.RegisterAllocatorFactory(&factory);
 
   runtime.RegisterStandardLibrary();
+  runtime.SetLeakReport(&std::cerr);
 
   NodeGraph graph(&runtime);
 
-  IntegerLiteralNode* a = runtime.AllocateAndGetWeakRef<IntegerLiteralNode>(3);
+  IntegerLiteralNode* a = graph.mArena->AllocateAndGetWeakRef<IntegerLiteralNode>(3);
 
-  IntegerLiteralNode* b = runtime.AllocateAndGetWeakRef<IntegerLiteralNode>(1);
+  IntegerLiteralNode* b = graph.mArena->AllocateAndGetWeakRef<IntegerLiteralNode>(1);
 
-  IntegerAdditionNode* add1 = runtime.AllocateAndGetWeakRef<IntegerAdditionNode>();
+  IntegerAdditionNode* add1 = graph.mArena->AllocateAndGetWeakRef<IntegerAdditionNode>();
   add1->mA.Connect(&a->mOut);
   add1->mB.Connect(&b->mOut);
 
-  AllocatorFactory::AbsoluteBlockHandle printref;
-  IntegerPrinterNode* p1 = runtime.AllocateAndGetWeakRefWithHandle<IntegerPrinterNode>(printref);
+  NodeHandle printref;
+  IntegerPrinterNode* p1 = graph.mArena->AllocateAndGetWeakRefWithHandle<IntegerPrinterNode>(printref);
   p1->mIn.Connect(&add1->mOut);
 
   graph.mFinals.push_back(printref);
 
   graph.Execute();
 
+  EliminateCommonSubexpressions(graph);
+
   NodeForest forest = Forestify(graph);
+  if (!forest.mError.empty())
+  {
+    std::cout << forest.mError << std::endl;
+    return;
+  }
+
+  OptimizeForest(forest);
+
   forest.Execute();
 
+  ThreadPool pool;
+  runtime.RegisterJobSystem(&pool);
+
+  ForestScheduler scheduler(forest);
+  scheduler.Execute();
+
+  BytecodeProgram program;
+  BytecodeCompiler compiler(&runtime);
+  if (compiler.Compile(forest, program))
+  {
+    BytecodeInterpreter interpreter;
+    interpreter.Execute(program);
+  }
+
   std::string cpp = forest.ToCPP();
 }
 
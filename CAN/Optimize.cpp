@@ -0,0 +1,515 @@
+﻿#include "Optimize.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                    Optimizer
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  // Dense on NodeHandle::mIndex
+  class NodeMarks
+  {
+  public:
+    bool Get(NodeHandle handle) const
+    {
+      return handle.mIndex < mMarks.size() && mMarks[handle.mIndex];
+    }
+
+    void Set(NodeHandle handle)
+    {
+      if (handle.mIndex >= mMarks.size())
+      {
+        mMarks.resize(handle.mIndex + 1, false);
+      }
+
+      mMarks[handle.mIndex] = true;
+    }
+
+  private:
+    std::vector<bool> mMarks;
+  };
+
+  // Moves every reader of node's output over to a new literal holding value
+  void ReplaceWithLiteral(NodeArena* arena, Node* node, int value, std::vector<NodeHandle>& created)
+  {
+    NodeHandle handle;
+    IntegerLiteralNode* literal = arena->AllocateAndGetWeakRefWithHandle<IntegerLiteralNode>(handle, value);
+    created.push_back(handle);
+
+    Slot* output = node->GetOutputSlots()[0];
+    for (Slot* reader : output->mConnectedTo)
+    {
+      reader->mConnectedTo.clear();
+      reader->Connect(&literal->mOut);
+    }
+
+    output->mConnectedTo.clear();
+  }
+
+  // Bumps reads[store] for every Load under root.  Trees don't share nodes
+  // after Forestify so there's nothing to mark.
+  void CountReads(RuntimeManager* runtime, NodeHandle root, std::unordered_map<NodeHandle, size_t, NodeHandleHasher>& reads)
+  {
+    std::vector<Node*> stack = { runtime->GetWeakRef(root) };
+
+    while (!stack.empty())
+    {
+      Node* node = stack.back();
+      stack.pop_back();
+
+      if (node->GetTypeGUID() == LoadIntegerVariableNode::TypeGUID)
+      {
+        ++reads[static_cast<LoadIntegerVariableNode*>(node)->GetPair()];
+      }
+
+      for (Slot* input : node->GetInputSlots())
+      {
+        if (!input->mConnectedTo.empty())
+        {
+          stack.push_back(input->mConnectedTo[0]->GetParent());
+        }
+      }
+    }
+  }
+}
+
+OptimizationReport CAN::OptimizeForest(NodeForest& forest, const std::vector<NodeHandle>* cluster)
+{
+  OptimizationReport report;
+
+  if (!forest.mError.empty())
+  {
+    return report;
+  }
+
+  RuntimeManager* runtime = forest.GetRuntime();
+
+  std::vector<NodeHandle> before = forest.mTopologicalOrder;
+  if (before.empty())
+  {
+    TopologicalOrder(runtime, forest.mRoots, before);
+  }
+
+  report.mNodesBefore = before.size();
+
+  // Fold, inputs come first so a folded input is already a literal by the
+  // time its reader gets asked
+  std::vector<NodeHandle> created;
+
+  for (NodeHandle handle : before)
+  {
+    Node* node = runtime->GetWeakRef(handle);
+
+    int value;
+    if (node->GetTypeGUID() == IntegerLiteralNode::TypeGUID || node->GetOutputSlots().empty() || !node->FoldConstant(value))
+    {
+      continue;
+    }
+
+    ReplaceWithLiteral(forest.mArena.get(), node, value, created);
+    ++report.mFoldedNodes;
+  }
+
+  // Drop unread Stores.  Readers always come after the Store they read in
+  // mRoots, so walking backwards has every read counted before a Store is
+  // looked at, including reads from Stores that get dropped themselves.
+  std::unordered_map<NodeHandle, size_t, NodeHandleHasher> reads;
+  std::vector<NodeHandle> roots;
+
+  for (size_t i = forest.mRoots.size(); i-- > 0;)
+  {
+    NodeHandle root = forest.mRoots[i];
+
+    if (runtime->GetWeakRef(root)->GetTypeGUID() == StoreIntegerVariableNode::TypeGUID && reads[root] == 0)
+    {
+      ++report.mRemovedStores;
+      continue;
+    }
+
+    roots.push_back(root);
+    CountReads(runtime, root, reads);
+  }
+
+  std::reverse(roots.begin(), roots.end());
+  forest.mRoots = roots;
+
+  forest.mEdges.Build(runtime, forest.mRoots);
+  forest.mTopologicalOrder = forest.mEdges.GetOrder();
+  report.mNodesAfter = forest.mTopologicalOrder.size();
+
+  // Free whatever the roots don't reach anymore
+  NodeMarks live;
+  for (NodeHandle handle : forest.mTopologicalOrder)
+  {
+    live.Set(handle);
+  }
+
+  NodeMarks seen;
+  std::vector<NodeHandle> dead;
+
+  auto consider = [&](NodeHandle handle)
+  {
+    if (!live.Get(handle) && !seen.Get(handle) && runtime->GetHandleTable().IsValid(handle))
+    {
+      seen.Set(handle);
+      dead.push_back(handle);
+    }
+  };
+
+  for (NodeHandle handle : before)
+  {
+    consider(handle);
+  }
+
+  for (NodeHandle handle : created)
+  {
+    consider(handle);
+  }
+
+  if (cluster)
+  {
+    for (NodeHandle handle : *cluster)
+    {
+      consider(handle);
+    }
+  }
+
+  // Whatever only dead nodes read is dead too, that includes the Loads
+  // Forestify put under unreachable readers, which nobody else lists
+  for (size_t i = 0; i < dead.size(); ++i)
+  {
+    for (Slot* input : runtime->GetWeakRef(dead[i])->GetInputSlots())
+    {
+      if (!input->mConnectedTo.empty())
+      {
+        consider(input->mConnectedTo[0]->GetParent()->GetHandle());
+      }
+    }
+  }
+
+  // Unhook everything first, a dead node can still be connected to a live
+  // output and the producer might get freed before the reader otherwise
+  for (NodeHandle handle : dead)
+  {
+    for (Slot* input : runtime->GetWeakRef(handle)->GetInputSlots())
+    {
+      while (!input->mConnectedTo.empty())
+      {
+        input->Disconnect(input->mConnectedTo.back());
+      }
+    }
+  }
+
+  for (NodeHandle handle : dead)
+  {
+    runtime->FreeNode(handle);
+  }
+
+  report.mFreedNodes = dead.size();
+
+  return report;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                             Common Subexpression Elimination
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  // Inputs are identified by the output they're connected to, after merging
+  // that's always the surviving copy
+  struct ValueKey
+  {
+    NodeTypeGUID mType;
+    uint64_t mData;
+    std::vector<Slot*> mInputs;
+
+    bool operator==(const ValueKey& other) const
+    {
+      return mType == other.mType && mData == other.mData && mInputs == other.mInputs;
+    }
+  };
+
+  struct ValueKeyHasher
+  {
+    size_t operator()(const ValueKey& key) const
+    {
+      size_t hash = std::hash<uint64_t>()(key.mType) ^ (std::hash<uint64_t>()(key.mData) * 31);
+      for (Slot* input : key.mInputs)
+      {
+        hash = hash * 65599 + std::hash<Slot*>()(input);
+      }
+
+      return hash;
+    }
+  };
+}
+
+size_t CAN::EliminateCommonSubexpressions(NodeGraph& graph)
+{
+  RuntimeManager* runtime = graph.GetRuntime();
+
+  std::vector<NodeHandle> order;
+  if (!TopologicalOrder(runtime, graph.mFinals, order))
+  {
+    return 0;
+  }
+
+  NodeMarks finals;
+  for (NodeHandle final : graph.mFinals)
+  {
+    finals.Set(final);
+  }
+
+  std::unordered_map<ValueKey, Node*, ValueKeyHasher> values;
+  std::vector<NodeHandle> merged;
+
+  for (NodeHandle handle : order)
+  {
+    Node* node = runtime->GetWeakRef(handle);
+
+    if (finals.Get(handle) || !runtime->IsPure(node->GetTypeGUID()))
+    {
+      continue;
+    }
+
+    ValueKey key{ node->GetTypeGUID(), node->GetDataKey(), {} };
+    for (Slot* input : node->GetInputSlots())
+    {
+      key.mInputs.push_back(input->mConnectedTo.empty() ? nullptr : input->mConnectedTo[0]);
+    }
+
+    auto found = values.find(key);
+    if (found == values.end())
+    {
+      values.emplace(std::move(key), node);
+      continue;
+    }
+
+    // Hand every reader over to the survivor, then unhook the copy so its
+    // producers don't look shared to Forestify
+    SlotRange outputs = node->GetOutputSlots();
+    SlotRange survivorOutputs = found->second->GetOutputSlots();
+
+    for (size_t i = 0; i < outputs.size(); ++i)
+    {
+      Slot* output = outputs[i];
+
+      while (!output->mConnectedTo.empty())
+      {
+        Slot* reader = output->mConnectedTo.back();
+        reader->Disconnect(output);
+        reader->Connect(survivorOutputs[i]);
+      }
+    }
+
+    for (Slot* input : node->GetInputSlots())
+    {
+      while (!input->mConnectedTo.empty())
+      {
+        input->Disconnect(input->mConnectedTo.back());
+      }
+    }
+
+    merged.push_back(handle);
+  }
+
+  for (NodeHandle handle : merged)
+  {
+    runtime->FreeNode(handle);
+  }
+
+  return merged.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 IR Optimizer
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  struct IRKey
+  {
+    IROp mOp;
+    SlotTypeGUID mType;
+    int mImmediate;
+    ValueId mOperands[2];
+
+    bool operator==(const IRKey& other) const
+    {
+      return mOp == other.mOp && mType == other.mType && mImmediate == other.mImmediate &&
+             mOperands[0] == other.mOperands[0] && mOperands[1] == other.mOperands[1];
+    }
+  };
+
+  struct IRKeyHasher
+  {
+    size_t operator()(const IRKey& key) const
+    {
+      size_t hash = size_t(key.mOp) * 31 + std::hash<SlotTypeGUID>()(key.mType);
+      hash = hash * 65599 + std::hash<int>()(key.mImmediate);
+      hash = hash * 65599 + key.mOperands[0];
+      return hash * 65599 + key.mOperands[1];
+    }
+  };
+}
+
+IROptimizationReport CAN::OptimizeIR(IRProgram& program)
+{
+  IROptimizationReport report;
+  report.mInstructionsBefore = program.mInstructions.size();
+
+  // Fold and merge, operands are always remapped already since they come first
+  std::vector<IRInstruction> kept;
+  std::vector<ValueId> remap(program.mInstructions.size(), NoValue);
+  std::unordered_map<IRKey, ValueId, IRKeyHasher> values;
+
+  kept.reserve(program.mInstructions.size());
+  values.reserve(program.mInstructions.size());
+
+  for (size_t i = 0; i < program.mInstructions.size(); ++i)
+  {
+    IRInstruction instruction = program.mInstructions[i];
+
+    for (uint8_t k = 0; k < instruction.mOperandCount; ++k)
+    {
+      instruction.mOperands[k] = remap[instruction.mOperands[k]];
+    }
+
+    if (instruction.mFlags & IRSideEffects)
+    {
+      remap[i] = ValueId(kept.size());
+      kept.push_back(instruction);
+      continue;
+    }
+
+    if (instruction.mOp == IROp::Add)
+    {
+      const IRInstruction& a = kept[instruction.mOperands[0]];
+      const IRInstruction& b = kept[instruction.mOperands[1]];
+
+      if (a.mOp == IROp::Constant && b.mOp == IROp::Constant)
+      {
+        instruction.mOp = IROp::Constant;
+        instruction.mImmediate = a.mImmediate + b.mImmediate;
+        instruction.mOperandCount = 0;
+        instruction.mOperands[0] = NoValue;
+        instruction.mOperands[1] = NoValue;
+        ++report.mFolded;
+      }
+    }
+
+    IRKey key{ instruction.mOp, instruction.mType, instruction.mImmediate, { instruction.mOperands[0], instruction.mOperands[1] } };
+
+    auto found = values.find(key);
+    if (found != values.end())
+    {
+      remap[i] = found->second;
+      ++report.mMerged;
+      continue;
+    }
+
+    remap[i] = ValueId(kept.size());
+    values.emplace(key, remap[i]);
+    kept.push_back(instruction);
+  }
+
+  // Drop dead values.  Walking backwards every reader is seen before the
+  // value it reads.
+  std::vector<bool> live(kept.size(), false);
+
+  for (size_t i = kept.size(); i-- > 0;)
+  {
+    const IRInstruction& instruction = kept[i];
+
+    if (instruction.mFlags & IRSideEffects)
+    {
+      live[i] = true;
+    }
+
+    if (live[i])
+    {
+      for (uint8_t k = 0; k < instruction.mOperandCount; ++k)
+      {
+        live[instruction.mOperands[k]] = true;
+      }
+    }
+  }
+
+  program.mInstructions.clear();
+  remap.assign(kept.size(), NoValue);
+
+  for (size_t i = 0; i < kept.size(); ++i)
+  {
+    if (!live[i])
+    {
+      ++report.mRemoved;
+      continue;
+    }
+
+    IRInstruction instruction = kept[i];
+    for (uint8_t k = 0; k < instruction.mOperandCount; ++k)
+    {
+      instruction.mOperands[k] = remap[instruction.mOperands[k]];
+    }
+
+    remap[i] = ValueId(program.mInstructions.size());
+    program.mInstructions.push_back(instruction);
+  }
+
+  report.mInstructionsAfter = program.mInstructions.size();
+  return report;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                             Standard Library
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  bool LiteralInput(Slot& input, int& value)
+  {
+    if (input.mConnectedTo.empty())
+    {
+      return false;
+    }
+
+    Node* producer = input.mConnectedTo[0]->GetParent();
+    if (producer->GetTypeGUID() != IntegerLiteralNode::TypeGUID)
+    {
+      return false;
+    }
+
+    value = static_cast<IntegerLiteralNode*>(producer)->mOut.mValue;
+    return true;
+  }
+}
+
+bool IntegerLiteralNode::FoldConstant(int& value)
+{
+  value = mOut.mValue;
+  return true;
+}
+
+bool IntegerAdditionNode::FoldConstant(int& value)
+{
+  int a, b;
+  if (!LiteralInput(mA, a) || !LiteralInput(mB, b))
+  {
+    return false;
+  }
+
+  value = a + b;
+  return true;
+}
+
+bool LoadIntegerVariableNode::FoldConstant(int& value)
+{
+  StoreIntegerVariableNode* store = static_cast<StoreIntegerVariableNode*>(GetRuntime()->GetWeakRef(mPair));
+  return LiteralInput(store->mIn, value);
+}
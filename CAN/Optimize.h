@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include "CAN.h"
+#include "IR.h"
+
+#include <cstddef>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                    Optimizer
+  ///////////////////////////////////////////////////////////////////////////////
+  // Runs between Forestify and whatever executes or transpiles the forest.
+  //
+  //   Folding       Any node whose FoldConstant succeeds is swapped for an
+  //                 IntegerLiteralNode, in topological order so literal only
+  //                 subtrees collapse all the way up.  Loads of a Store that
+  //                 ends up holding a literal fold too.  The literals come
+  //                 out of the forest's mArena.
+  //   Dead Stores   Store roots that no Load reads anymore are dropped along
+  //                 with their trees.
+  //   Dead Nodes    Everything no root reaches anymore is freed.  Pass the
+  //                 cluster the graph was built from to also free nodes that
+  //                 were never reachable in the first place.
+  //
+  // Printers are never folded away, every root that isn't a dead Store stays.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  struct OptimizationReport
+  {
+    size_t mNodesBefore = 0;   // Reachable from the roots
+    size_t mNodesAfter = 0;
+    size_t mFoldedNodes = 0;   // Replaced by a literal
+    size_t mRemovedStores = 0; // Store roots nothing read
+    size_t mFreedNodes = 0;    // Includes unreachable cluster nodes
+  };
+
+  // Will ruin forest FYI, it's left optimized with mTopologicalOrder and mEdges rebuilt.
+  // Does nothing to a forest with mError set.
+  OptimizationReport OptimizeForest(NodeForest& forest, const std::vector<NodeHandle>* cluster = nullptr);
+
+  // Hash conses the graph before Forestify.  Pure nodes with the same type,
+  // GetDataKey and input producers are merged into the first one found, its
+  // output picks up every reader of the copies and Forestify then shares it
+  // through a Store/Load like any other fan-out.  Copies are freed.  Finals are
+  // never merged.  Returns how many nodes were merged away, 0 if the graph has
+  // a cycle.
+  size_t EliminateCommonSubexpressions(NodeGraph& graph);
+
+  struct IROptimizationReport
+  {
+    size_t mInstructionsBefore = 0;
+    size_t mInstructionsAfter = 0;
+    size_t mFolded = 0;  // Adds of two constants
+    size_t mMerged = 0;  // Same op, type, immediate and operands as an earlier one
+    size_t mRemoved = 0; // Nothing with side effects ended up reading them
+  };
+
+  // The same three passes for the IR, folding and hash consing in one forward
+  // walk and dropping dead values in one backward walk.  Instructions with
+  // IRSideEffects are never folded, merged or removed.  Value ids are
+  // renumbered.
+  IROptimizationReport OptimizeIR(IRProgram& program);
+}
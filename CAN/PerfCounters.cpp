@@ -0,0 +1,348 @@
+﻿#include "PerfCounters.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace CAN;
+
+namespace
+{
+  uint64_t SteadyNs()
+  {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+#ifdef __linux__
+  struct CounterConfig
+  {
+    uint32_t mType;
+    uint64_t mConfig;
+  };
+
+  const CounterConfig Configs[PerfCounterCount] =
+  {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+  };
+
+  int OpenCounter(const CounterConfig& config, int group)
+  {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = config.mType;
+    attr.config = config.mConfig;
+    attr.disabled = group == -1; // Members follow the leader
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return int(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+  }
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                Perf Counters
+///////////////////////////////////////////////////////////////////////////////
+
+void PerfSample::Add(const PerfSample& other)
+{
+  mValid = mRuns ? (mValid & other.mValid) : other.mValid;
+  mRuns += other.mRuns;
+  mMs += other.mMs;
+
+  for (size_t i = 0; i < PerfCounterCount; ++i)
+  {
+    mValues[i] += other.mValues[i];
+  }
+}
+
+PerfCounters::PerfCounters()
+{
+  std::fill(mFds, mFds + PerfCounterCount, -1);
+}
+
+PerfCounters::~PerfCounters() { Close(); }
+
+bool PerfCounters::Open(std::string& error)
+{
+  Close();
+
+#ifdef __linux__
+  int firstErrno = 0;
+
+  for (size_t i = 0; i < PerfCounterCount; ++i)
+  {
+    int fd = OpenCounter(Configs[i], mLeader);
+    if (fd == -1)
+    {
+      firstErrno = firstErrno ? firstErrno : errno;
+      continue;
+    }
+
+    if (mLeader == -1)
+    {
+      mLeader = fd;
+    }
+
+    mFds[i] = fd;
+    mOrder[mOpened++] = uint8_t(i);
+  }
+
+  if (mOpened == 0)
+  {
+    error = std::string("Perf counters: perf_event_open failed, ") + std::strerror(firstErrno);
+    if (firstErrno == EACCES || firstErrno == EPERM)
+    {
+      error += " (see /proc/sys/kernel/perf_event_paranoid)";
+    }
+    return false;
+  }
+
+  return true;
+#else
+  error = "Perf counters: needs Linux perf_event_open";
+  return false;
+#endif
+}
+
+void PerfCounters::Close()
+{
+#ifdef __linux__
+  // Members first, the leader is one of them
+  for (int& fd : mFds)
+  {
+    if (fd != -1 && fd != mLeader)
+    {
+      close(fd);
+    }
+    fd = -1;
+  }
+
+  if (mLeader != -1)
+  {
+    close(mLeader);
+  }
+#endif
+
+  mLeader = -1;
+  mOpened = 0;
+}
+
+bool PerfCounters::IsAvailable(PerfCounter counter) const { return mFds[size_t(counter)] != -1; }
+
+void PerfCounters::Start()
+{
+#ifdef __linux__
+  if (mLeader != -1)
+  {
+    ioctl(mLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+
+  mStartNs = SteadyNs();
+
+#ifdef __linux__
+  if (mLeader != -1)
+  {
+    ioctl(mLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+}
+
+void PerfCounters::Stop(PerfSample& sample)
+{
+#ifdef __linux__
+  if (mLeader != -1)
+  {
+    ioctl(mLeader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+
+  uint64_t endNs = SteadyNs();
+
+  sample = PerfSample();
+  sample.mRuns = 1;
+  sample.mMs = (endNs - mStartNs) / 1e6;
+
+#ifdef __linux__
+  if (mLeader == -1)
+  {
+    return;
+  }
+
+  // nr, time enabled, time running, then a value per member in open order
+  uint64_t data[3 + PerfCounterCount];
+  ssize_t size = read(mLeader, data, sizeof(data));
+
+  // Never scheduled, the PMU couldn't fit the group
+  if (size < ssize_t(3 * sizeof(uint64_t)) || data[2] == 0)
+  {
+    return;
+  }
+
+  double scale = double(data[1]) / double(data[2]);
+
+  for (size_t i = 0; i < data[0] && i < mOpened; ++i)
+  {
+    sample.mValues[mOrder[i]] = uint64_t(data[3 + i] * scale + 0.5);
+    sample.mValid |= uint8_t(1 << mOrder[i]);
+  }
+#endif
+}
+
+const char* PerfCounters::GetName(PerfCounter counter)
+{
+  switch (counter)
+  {
+  case PerfCounter::Cycles:
+    return "cycles";
+  case PerfCounter::Instructions:
+    return "instructions";
+  case PerfCounter::L1DMisses:
+    return "l1d_misses";
+  case PerfCounter::LLCMisses:
+    return "llc_misses";
+  case PerfCounter::BranchMisses:
+    return "branch_misses";
+  default:
+    return "unknown";
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                  Perf Report
+///////////////////////////////////////////////////////////////////////////////
+
+PerfReport::PerfReport(RuntimeManager* runtime, PerfCounters& counters) : mManager(runtime), mCounters(counters) {}
+
+void PerfReport::MeasureForest(NodeForest& forest, const std::string& name)
+{
+  PerfSample sample;
+  mCounters.Start();
+  forest.Execute();
+  mCounters.Stop(sample);
+
+  auto itr = std::find_if(mGraphs.begin(), mGraphs.end(), [&name](const std::pair<std::string, PerfSample>& graph) { return graph.first == name; });
+  if (itr == mGraphs.end())
+  {
+    mGraphs.emplace_back(name, PerfSample());
+    itr = mGraphs.end() - 1;
+  }
+
+  itr->second.Add(sample);
+}
+
+void PerfReport::MeasureRoots(NodeForest& forest)
+{
+  PerfSample sample;
+
+  for (NodeHandle handle : forest.mRoots)
+  {
+    Node* root = mManager->GetWeakRef(handle);
+
+    mCounters.Start();
+    root->Run();
+    mCounters.Stop(sample);
+
+    mTypes[root->GetTypeGUID()].Add(sample);
+  }
+}
+
+void PerfReport::Clear()
+{
+  mGraphs.clear();
+  mTypes.clear();
+}
+
+const std::vector<std::pair<std::string, PerfSample>>& PerfReport::GetGraphs() const { return mGraphs; }
+
+const std::unordered_map<NodeTypeGUID, PerfSample>& PerfReport::GetTypes() const { return mTypes; }
+
+void PerfReport::WriteSummary(std::ostream& out) const
+{
+  auto header = [&out](const char* title)
+  {
+    out << "\n" << std::left << std::setw(30) << title << std::right << std::setw(10) << "runs" << std::setw(12) << "ms"
+        << std::setw(16) << "cycles" << std::setw(16) << "instructions" << std::setw(8) << "ipc"
+        << std::setw(10) << "l1d/ki" << std::setw(10) << "llc/ki" << std::setw(10) << "br/ki" << "\n";
+  };
+
+  auto row = [&out](const std::string& name, const PerfSample& sample)
+  {
+    out << std::left << std::setw(30) << name << std::right << std::setw(10) << sample.mRuns << std::setw(12) << sample.mMs;
+
+    auto count = [&out, &sample](PerfCounter counter)
+    {
+      if (sample.IsValid(counter))
+      {
+        out << std::setw(16) << sample.Get(counter);
+      }
+      else
+      {
+        out << std::setw(16) << "-";
+      }
+    };
+
+    count(PerfCounter::Cycles);
+    count(PerfCounter::Instructions);
+
+    bool haveInstructions = sample.IsValid(PerfCounter::Instructions) && sample.Get(PerfCounter::Instructions);
+    uint64_t instructions = sample.Get(PerfCounter::Instructions);
+
+    if (haveInstructions && sample.IsValid(PerfCounter::Cycles) && sample.Get(PerfCounter::Cycles))
+    {
+      out << std::setw(8) << double(instructions) / sample.Get(PerfCounter::Cycles);
+    }
+    else
+    {
+      out << std::setw(8) << "-";
+    }
+
+    // Per thousand instructions
+    for (PerfCounter counter : { PerfCounter::L1DMisses, PerfCounter::LLCMisses, PerfCounter::BranchMisses })
+    {
+      if (haveInstructions && sample.IsValid(counter))
+      {
+        out << std::setw(10) << sample.Get(counter) * 1000.0 / instructions;
+      }
+      else
+      {
+        out << std::setw(10) << "-";
+      }
+    }
+
+    out << "\n";
+  };
+
+  out << std::fixed << std::setprecision(3);
+
+  header("Graphs");
+  for (const auto& graph : mGraphs)
+  {
+    row(graph.first, graph.second);
+  }
+
+  std::vector<std::pair<NodeTypeGUID, PerfSample>> types(mTypes.begin(), mTypes.end());
+  std::sort(types.begin(), types.end(), [](const std::pair<NodeTypeGUID, PerfSample>& a, const std::pair<NodeTypeGUID, PerfSample>& b) { return a.second.mMs > b.second.mMs; });
+
+  header("Root types");
+  for (const auto& type : types)
+  {
+    row(mManager->GetNodeTypeName(type.first), type.second);
+  }
+}
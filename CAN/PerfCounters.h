@@ -0,0 +1,122 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                Perf Counters
+  ///////////////////////////////////////////////////////////////////////////////
+  // Hardware counters read through perf_event_open on Linux, so a slow graph
+  // can be told apart as cache bound or branch bound rather than just slow.
+  //
+  // All the counters are opened as one group for the calling thread only,
+  // user space only, so they start and stop together and are multiplexed
+  // together.  Counts are scaled up by how long the group actually ran when
+  // the kernel had to share the PMU.  Whatever can't be opened (no PMU in a
+  // VM, perf_event_paranoid, not Linux) is just missing from the results and
+  // timing always works, Open only says why.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  enum class PerfCounter : uint8_t
+  {
+    Cycles,
+    Instructions,
+    L1DMisses,   // L1 data cache read misses
+    LLCMisses,   // Last level cache misses
+    BranchMisses,
+    Count
+  };
+
+  static constexpr size_t PerfCounterCount = size_t(PerfCounter::Count);
+
+  struct PerfSample
+  {
+    uint64_t mRuns = 0;
+    double mMs = 0.0;
+    uint64_t mValues[PerfCounterCount] = {};
+    uint8_t mValid = 0; // Bit per PerfCounter that was counted in every run
+
+    void Add(const PerfSample& other);
+
+    bool IsValid(PerfCounter counter) const { return (mValid >> size_t(counter)) & 1; }
+    uint64_t Get(PerfCounter counter) const { return mValues[size_t(counter)]; }
+  };
+
+  class PerfCounters
+  {
+  public:
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Opens every counter it can for the calling thread.  False with the
+    // reason in error when none could be, Start and Stop then only time.
+    bool Open(std::string& error);
+    void Close();
+
+    bool IsAvailable(PerfCounter counter) const;
+
+    // Only from the thread that called Open, Stop overwrites sample with a
+    // single run
+    void Start();
+    void Stop(PerfSample& sample);
+
+    static const char* GetName(PerfCounter counter);
+
+  private:
+    int mLeader = -1;
+    int mFds[PerfCounterCount];
+    uint8_t mOrder[PerfCounterCount]; // Which counter each group read value is
+    size_t mOpened = 0;
+
+    uint64_t mStartNs = 0;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                  Perf Report
+  ///////////////////////////////////////////////////////////////////////////////
+  // Runs forests with a PerfCounters around them and keeps the totals per
+  // graph name and per node type.
+  //
+  // MeasureRoots runs the roots one at a time the way NodeForest::Execute
+  // does and puts each one's counts under its node type, so a type's numbers
+  // include everything its roots pulled in beneath them.  Counters only see
+  // the calling thread, so this is for single threaded execution and not
+  // ForestScheduler.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class PerfReport
+  {
+  public:
+    PerfReport(RuntimeManager* runtime, PerfCounters& counters);
+
+    void MeasureForest(NodeForest& forest, const std::string& name);
+    void MeasureRoots(NodeForest& forest);
+
+    void Clear();
+
+    const std::vector<std::pair<std::string, PerfSample>>& GetGraphs() const;
+    const std::unordered_map<NodeTypeGUID, PerfSample>& GetTypes() const;
+
+    // A table per graph and per type with IPC and misses per thousand
+    // instructions where the counters are there
+    void WriteSummary(std::ostream& out) const;
+
+  private:
+    RuntimeManager* mManager;
+    PerfCounters& mCounters;
+
+    std::vector<std::pair<std::string, PerfSample>> mGraphs; // In first measured order
+    std::unordered_map<NodeTypeGUID, PerfSample> mTypes;
+  };
+}
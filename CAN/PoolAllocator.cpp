@@ -0,0 +1,170 @@
+﻿#include "PoolAllocator.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                               Pool Allocator
+///////////////////////////////////////////////////////////////////////////////
+
+PoolAllocator::PoolAllocator(AllocatorFactory::AllocatorHandle handle, size_t size, NodeTypeGUID type, size_t pageSize)
+  : mHandle(handle), mNodeType(type)
+{
+  // Every block has to be able to hold a FreeBlock and stay aligned for any node
+  const size_t alignment = alignof(std::max_align_t);
+  size_t blockSize = size < sizeof(FreeBlock) ? sizeof(FreeBlock) : size;
+  mBlockSize = (blockSize + alignment - 1) & ~(alignment - 1);
+
+  // Largest power of two number of blocks that fits in a page, at least one
+  mPageShift = 0;
+  while ((mBlockSize << (mPageShift + 1)) <= pageSize)
+  {
+    ++mPageShift;
+  }
+
+  mPageMask = (size_t(1) << mPageShift) - 1;
+}
+
+PoolAllocator::~PoolAllocator()
+{
+  for (char* page : mPages)
+  {
+    ::operator delete(page);
+  }
+}
+
+AllocatorFactory::RelativeBlockHandle PoolAllocator::Allocate()
+{
+  if (!mFreeList)
+  {
+    AddPage();
+  }
+
+  FreeBlock* block = mFreeList;
+  mFreeList = block->mNext;
+  ++mLiveCount;
+
+  return block->mIndex;
+}
+
+void PoolAllocator::Free(AllocatorFactory::RelativeBlockHandle handle)
+{
+  assert(mLiveCount > 0);
+
+  FreeBlock* block = static_cast<FreeBlock*>(GetWeakRef(handle));
+  block->mNext = mFreeList;
+  block->mIndex = handle;
+
+  mFreeList = block;
+  --mLiveCount;
+}
+
+void PoolAllocator::AllocateBulk(size_t count, AllocatorFactory::RelativeBlockHandle* handles)
+{
+  size_t i = 0;
+
+  for (; i < count && mFreeList; ++i)
+  {
+    handles[i] = mFreeList->mIndex;
+    mFreeList = mFreeList->mNext;
+  }
+
+  const size_t blocksPerPage = mPageMask + 1;
+
+  while (i < count)
+  {
+    mPages.push_back(static_cast<char*>(::operator new(blocksPerPage * mBlockSize)));
+
+    size_t page = mPages.size() - 1;
+    size_t first = page << mPageShift;
+    size_t taken = std::min(blocksPerPage, count - i);
+
+    for (size_t b = 0; b < taken; ++b)
+    {
+      handles[i++] = first + b;
+    }
+
+    if (taken < blocksPerPage)
+    {
+      ThreadPage(page, taken);
+    }
+  }
+
+  mLiveCount += count;
+}
+
+void PoolAllocator::FreeBulk(size_t count, const AllocatorFactory::RelativeBlockHandle* handles)
+{
+  assert(mLiveCount >= count);
+
+  for (size_t i = count; i-- > 0;)
+  {
+    FreeBlock* block = static_cast<FreeBlock*>(GetWeakRef(handles[i]));
+    block->mNext = mFreeList;
+    block->mIndex = handles[i];
+    mFreeList = block;
+  }
+
+  mLiveCount -= count;
+}
+
+void* PoolAllocator::GetWeakRef(AllocatorFactory::RelativeBlockHandle handle)
+{
+  assert((handle >> mPageShift) < mPages.size());
+  return mPages[handle >> mPageShift] + (handle & mPageMask) * mBlockSize;
+}
+
+AllocatorFactory::AllocatorHandle PoolAllocator::GetAllocatorHandle() { return mHandle; }
+
+size_t PoolAllocator::GetReservedBytes() { return mPages.size() * (mPageMask + 1) * mBlockSize; }
+
+void PoolAllocator::AddPage()
+{
+  mPages.push_back(static_cast<char*>(::operator new((mPageMask + 1) * mBlockSize)));
+  ThreadPage(mPages.size() - 1);
+}
+
+void PoolAllocator::ThreadPage(size_t page, size_t first)
+{
+  char* base = mPages[page];
+  size_t pageStart = page << mPageShift;
+
+  // Pushed back to front so the page gets handed out front to back
+  for (size_t i = mPageMask + 1; i-- > first;)
+  {
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(base + i * mBlockSize);
+    block->mNext = mFreeList;
+    block->mIndex = pageStart + i;
+    mFreeList = block;
+  }
+}
+
+size_t PoolAllocator::GetBlockSize() const { return mBlockSize; }
+size_t PoolAllocator::GetBlocksPerPage() const { return mPageMask + 1; }
+size_t PoolAllocator::GetPageCount() const { return mPages.size(); }
+size_t PoolAllocator::GetLiveCount() const { return mLiveCount; }
+NodeTypeGUID PoolAllocator::GetNodeType() const { return mNodeType; }
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                       Pool Allocator Factory
+///////////////////////////////////////////////////////////////////////////////
+
+PoolAllocatorFactory::PoolAllocatorFactory(size_t pageSize) : mPageSize(pageSize) {}
+
+AllocatorFactory::AllocatorHandle PoolAllocatorFactory::MakeAllocator(size_t size, NodeTypeGUID uid)
+{
+  AllocatorHandle handle = mAllocators.size();
+  mAllocators.push_back(std::make_unique<PoolAllocator>(handle, size, uid, mPageSize));
+
+  return handle;
+}
+
+void PoolAllocatorFactory::FreeAllocator(Allocator* alloc)
+{
+  mAllocators[alloc->GetAllocatorHandle()].reset();
+}
+
+Allocator* PoolAllocatorFactory::LookupAllocator(AllocatorHandle handle) { return mAllocators[handle].get(); }
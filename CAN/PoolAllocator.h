@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                               Pool Allocator
+  ///////////////////////////////////////////////////////////////////////////////
+  // One pool per node type.  Blocks are carved out of fixed size pages so nodes
+  // of the same type end up packed next to each other, and free blocks are
+  // threaded through an intrusive list so Allocate and Free are both O(1).
+  //
+  // Relative handles are block indices, page = index >> shift, which keeps
+  // GetWeakRef down to a shift, a mask and a multiply.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class PoolAllocator final : public Allocator
+  {
+  public:
+    PoolAllocator(AllocatorFactory::AllocatorHandle handle, size_t size, NodeTypeGUID type, size_t pageSize);
+    ~PoolAllocator();
+
+    AllocatorFactory::RelativeBlockHandle Allocate() override;
+    void Free(AllocatorFactory::RelativeBlockHandle handle) override;
+
+    // Drains the free list, then takes whole fresh pages front to back without
+    // threading them.  Only the unused tail of the last page is threaded.
+    void AllocateBulk(size_t count, AllocatorFactory::RelativeBlockHandle* handles) override;
+
+    // Threads the blocks back on in reverse so they come out of Allocate in
+    // the order they were given
+    void FreeBulk(size_t count, const AllocatorFactory::RelativeBlockHandle* handles) override;
+
+    void* GetWeakRef(AllocatorFactory::RelativeBlockHandle handle) override;
+
+    AllocatorFactory::AllocatorHandle GetAllocatorHandle() override;
+
+    // Every page, live blocks or not
+    size_t GetReservedBytes() override;
+
+    size_t GetBlockSize() const;
+    size_t GetBlocksPerPage() const;
+    size_t GetPageCount() const;
+    size_t GetLiveCount() const;
+    NodeTypeGUID GetNodeType() const;
+
+  private:
+    // Lives in the first bytes of every free block
+    struct FreeBlock
+    {
+      FreeBlock* mNext;
+      AllocatorFactory::RelativeBlockHandle mIndex;
+    };
+
+    void AddPage();
+    void ThreadPage(size_t page, size_t first = 0);
+
+    AllocatorFactory::AllocatorHandle mHandle;
+    NodeTypeGUID mNodeType;
+
+    size_t mBlockSize;
+    size_t mPageShift;
+    size_t mPageMask;
+
+    std::vector<char*> mPages;
+    FreeBlock* mFreeList = nullptr;
+    size_t mLiveCount = 0;
+  };
+
+  class PoolAllocatorFactory final : public AllocatorFactory
+  {
+  public:
+    static const size_t DefaultPageSize = 64 * 1024;
+
+    PoolAllocatorFactory(size_t pageSize = DefaultPageSize);
+
+    AllocatorHandle MakeAllocator(size_t size, NodeTypeGUID uid) override;
+    void FreeAllocator(Allocator* alloc) override;
+
+    Allocator* LookupAllocator(AllocatorHandle handle) override;
+
+  private:
+    size_t mPageSize;
+    std::vector<std::unique_ptr<PoolAllocator>> mAllocators;
+  };
+}
@@ -0,0 +1,368 @@
+﻿#include "Profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <unordered_map>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CAN_PROFILE_TSC 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#else
+#define CAN_PROFILE_TSC 0
+#endif
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                     Profiler
+///////////////////////////////////////////////////////////////////////////////
+
+#if CAN_PROFILE
+void Node::Run()
+{
+  Profiler* profiler = mManager->GetProfiler();
+  if (!profiler)
+  {
+    Execute();
+    return;
+  }
+
+  profiler->Enter(mHandle, GetTypeGUID());
+  Execute();
+  profiler->Exit();
+}
+#endif
+
+namespace
+{
+  std::atomic<uint64_t> gNextProfilerId(1);
+
+  // The last profiler this thread recorded into and its state in it, so Enter
+  // only locks the first time a thread shows up
+  struct ThreadCache
+  {
+    uint64_t mProfiler = 0;
+    void* mState = nullptr;
+  };
+
+  thread_local ThreadCache tCache;
+
+  uint64_t SteadyNs()
+  {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+}
+
+Profiler::Profiler(RuntimeManager* runtime, size_t maxEventsPerThread)
+  : mManager(runtime), mMaxEvents(maxEventsPerThread), mId(gNextProfilerId++), mStartTicks(Now()), mStartNs(SteadyNs())
+{
+}
+
+void Profiler::Enter(NodeHandle handle, NodeTypeGUID type)
+{
+  ThreadState& state = GetThreadState();
+  state.mStack.push_back({ handle, type, Now(), 0 });
+}
+
+void Profiler::Exit()
+{
+  uint64_t end = Now();
+
+  ThreadState& state = GetThreadState();
+  assert(!state.mStack.empty() && "Profiler::Exit without an Enter");
+
+  Frame frame = state.mStack.back();
+  state.mStack.pop_back();
+
+  uint64_t elapsed = end - frame.mStart;
+
+  if (!state.mStack.empty())
+  {
+    state.mStack.back().mChildren += elapsed;
+  }
+
+  if (frame.mHandle.mIndex >= state.mNodes.size())
+  {
+    state.mNodes.resize(frame.mHandle.mIndex + 1, NodeTotals{ {}, 0, 0, 0, 0, 0 });
+  }
+
+  NodeTotals& totals = state.mNodes[frame.mHandle.mIndex];
+  if (totals.mCalls == 0 || totals.mHandle != frame.mHandle)
+  {
+    totals = { frame.mHandle, frame.mType, 0, 0, 0, 0 };
+  }
+
+  ++totals.mCalls;
+  totals.mRootCalls += state.mStack.empty();
+  totals.mInclusive += elapsed;
+  totals.mExclusive += elapsed - frame.mChildren;
+
+  if (state.mEvents.size() < mMaxEvents)
+  {
+    state.mEvents.push_back({ frame.mHandle, frame.mType, frame.mStart, end });
+  }
+  else
+  {
+    ++state.mDroppedEvents;
+  }
+}
+
+void Profiler::Clear()
+{
+  std::lock_guard<std::mutex> lock(mThreadsMutex);
+
+  for (auto& state : mThreads)
+  {
+    state->mStack.clear();
+    state->mNodes.clear();
+    state->mEvents.clear();
+    state->mDroppedEvents = 0;
+  }
+
+  mStartTicks = Now();
+  mStartNs = SteadyNs();
+}
+
+void Profiler::GetNodeProfiles(std::vector<NodeProfile>& profiles) const
+{
+  profiles.clear();
+
+  const double ticksPerUs = TicksPerUs();
+  std::unordered_map<NodeHandle, size_t, NodeHandleHasher> found;
+
+  std::lock_guard<std::mutex> lock(mThreadsMutex);
+
+  for (const auto& state : mThreads)
+  {
+    for (const NodeTotals& totals : state->mNodes)
+    {
+      if (totals.mCalls == 0)
+      {
+        continue;
+      }
+
+      auto itr = found.find(totals.mHandle);
+      if (itr == found.end())
+      {
+        itr = found.emplace(totals.mHandle, profiles.size()).first;
+        profiles.push_back({ totals.mHandle, totals.mType, 0, 0, 0.0, 0.0 });
+      }
+
+      NodeProfile& profile = profiles[itr->second];
+      profile.mCalls += totals.mCalls;
+      profile.mRootCalls += totals.mRootCalls;
+      profile.mInclusiveUs += totals.mInclusive / ticksPerUs;
+      profile.mExclusiveUs += totals.mExclusive / ticksPerUs;
+    }
+  }
+
+  std::sort(profiles.begin(), profiles.end(), [](const NodeProfile& a, const NodeProfile& b) { return a.mExclusiveUs > b.mExclusiveUs; });
+}
+
+void Profiler::GetTypeProfiles(std::vector<TypeProfile>& profiles) const
+{
+  profiles.clear();
+
+  std::vector<NodeProfile> nodes;
+  GetNodeProfiles(nodes);
+
+  std::unordered_map<NodeTypeGUID, size_t> found;
+
+  for (const NodeProfile& node : nodes)
+  {
+    auto itr = found.find(node.mType);
+    if (itr == found.end())
+    {
+      itr = found.emplace(node.mType, profiles.size()).first;
+      profiles.push_back({ node.mType, 0, 0.0, 0.0 });
+    }
+
+    TypeProfile& profile = profiles[itr->second];
+    profile.mCalls += node.mCalls;
+    profile.mInclusiveUs += node.mInclusiveUs;
+    profile.mExclusiveUs += node.mExclusiveUs;
+  }
+
+  std::sort(profiles.begin(), profiles.end(), [](const TypeProfile& a, const TypeProfile& b) { return a.mExclusiveUs > b.mExclusiveUs; });
+}
+
+void Profiler::WriteChromeTrace(std::ostream& out) const
+{
+  const double ticksPerUs = TicksPerUs();
+
+  // Names are looked up once per type rather than per event
+  std::unordered_map<NodeTypeGUID, std::string> names;
+
+  std::lock_guard<std::mutex> lock(mThreadsMutex);
+
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  out << std::fixed << std::setprecision(3);
+
+  bool first = true;
+  for (const auto& state : mThreads)
+  {
+    out << (first ? "" : ",\n");
+    out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << state->mId << ", \"args\": {\"name\": \"CAN " << state->mId << "\"}}";
+    first = false;
+
+    for (const Event& event : state->mEvents)
+    {
+      auto name = names.find(event.mType);
+      if (name == names.end())
+      {
+        name = names.emplace(event.mType, GetTypeName(event.mType)).first;
+      }
+
+      out << ",\n{\"name\": \"" << name->second << "\", \"cat\": \"node\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << state->mId
+          << ", \"ts\": " << (event.mStart - mStartTicks) / ticksPerUs << ", \"dur\": " << (event.mEnd - event.mStart) / ticksPerUs
+          << ", \"args\": {\"handle\": \"" << event.mHandle.mIndex << ":" << event.mHandle.mGeneration << "\"}}";
+    }
+  }
+
+  out << "\n]}\n";
+}
+
+void Profiler::WriteSummary(std::ostream& out, size_t maxNodes) const
+{
+  std::vector<NodeProfile> nodes;
+  GetNodeProfiles(nodes);
+
+  std::vector<TypeProfile> types;
+  GetTypeProfiles(types);
+
+  uint64_t calls = 0;
+  uint64_t dropped = 0;
+  double rootUs = 0.0;
+
+  for (const NodeProfile& node : nodes)
+  {
+    calls += node.mCalls;
+    rootUs += node.mRootCalls ? node.mInclusiveUs : 0.0;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mThreadsMutex);
+    for (const auto& state : mThreads)
+    {
+      dropped += state->mDroppedEvents;
+    }
+  }
+
+  out << std::fixed << std::setprecision(3);
+  out << "CAN profile: " << calls << " calls, " << rootUs / 1000.0 << " ms in roots";
+  if (dropped)
+  {
+    out << ", " << dropped << " events past the trace limit";
+  }
+  out << "\n";
+
+  auto row = [&out](const std::string& name, uint64_t count, double inclusiveUs, double exclusiveUs)
+  {
+    out << "  " << std::left << std::setw(40) << name << std::right << std::setw(12) << count
+        << std::setw(14) << inclusiveUs / 1000.0 << std::setw(14) << exclusiveUs / 1000.0 << "\n";
+  };
+
+  auto header = [&out](const char* title)
+  {
+    out << "\n" << std::left << std::setw(42) << title << std::right << std::setw(12) << "calls"
+        << std::setw(14) << "incl ms" << std::setw(14) << "excl ms" << "\n";
+  };
+
+  header("Types");
+  for (const TypeProfile& type : types)
+  {
+    row(GetTypeName(type.mType), type.mCalls, type.mInclusiveUs, type.mExclusiveUs);
+  }
+
+  auto label = [this](const NodeProfile& node)
+  {
+    return GetTypeName(node.mType) + " " + std::to_string(node.mHandle.mIndex) + ":" + std::to_string(node.mHandle.mGeneration);
+  };
+
+  header("Nodes");
+  for (size_t i = 0; i < nodes.size() && i < maxNodes; ++i)
+  {
+    row(label(nodes[i]), nodes[i].mCalls, nodes[i].mInclusiveUs, nodes[i].mExclusiveUs);
+  }
+
+  std::sort(nodes.begin(), nodes.end(), [](const NodeProfile& a, const NodeProfile& b) { return a.mInclusiveUs > b.mInclusiveUs; });
+
+  header("Roots");
+  for (const NodeProfile& node : nodes)
+  {
+    if (node.mRootCalls)
+    {
+      row(label(node), node.mRootCalls, node.mInclusiveUs, node.mExclusiveUs);
+    }
+  }
+}
+
+uint64_t Profiler::Now()
+{
+#if CAN_PROFILE_TSC
+  return __rdtsc();
+#else
+  return SteadyNs();
+#endif
+}
+
+Profiler::ThreadState& Profiler::GetThreadState()
+{
+  if (tCache.mProfiler == mId)
+  {
+    return *static_cast<ThreadState*>(tCache.mState);
+  }
+
+  std::lock_guard<std::mutex> lock(mThreadsMutex);
+
+  // This thread might have used another profiler since it was last here
+  ThreadState* state = nullptr;
+  for (auto& existing : mThreads)
+  {
+    if (existing->mThread == std::this_thread::get_id())
+    {
+      state = existing.get();
+    }
+  }
+
+  if (!state)
+  {
+    mThreads.push_back(std::make_unique<ThreadState>());
+    state = mThreads.back().get();
+    state->mThread = std::this_thread::get_id();
+    state->mId = static_cast<uint32_t>(mThreads.size() - 1);
+  }
+
+  tCache.mProfiler = mId;
+  tCache.mState = state;
+
+  return *state;
+}
+
+double Profiler::TicksPerUs() const
+{
+#if CAN_PROFILE_TSC
+  uint64_t ticks = Now() - mStartTicks;
+  uint64_t ns = SteadyNs() - mStartNs;
+
+  return ns ? ticks * 1000.0 / ns : 1.0;
+#else
+  return 1000.0;
+#endif
+}
+
+std::string Profiler::GetTypeName(NodeTypeGUID type) const
+{
+  if (mManager->GetTypeIndex(type) == InvalidNodeTypeIndex)
+  {
+    return std::to_string(type);
+  }
+
+  return mManager->GetNodeTypeName(type);
+}
@@ -0,0 +1,132 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                     Profiler
+  ///////////////////////////////////////////////////////////////////////////////
+  // Per node timing for anything that runs nodes through Node::Run.  Register
+  // one with RuntimeManager::RegisterProfiler and build with CAN_PROFILE=1,
+  // without it Node::Run is Execute and nothing here ever gets called.
+  //
+  // Every call is a frame on a per thread stack, time spent in frames opened
+  // under it counts towards its inclusive time but not its exclusive time.
+  // Calls at the bottom of the stack are roots.  Totals are kept per node
+  // handle as they happen, per type is worked out from those when asked.
+  // Each call is also kept as an event for WriteChromeTrace until a thread hits
+  // maxEventsPerThread, totals keep going after that.
+  //
+  // Backends that don't go through Node::Run can call Enter and Exit
+  // themselves, under #if CAN_PROFILE so they cost nothing without it.
+  // Timestamps come from the TSC where there is one and steady_clock
+  // otherwise, converted using how far both moved since the last Clear.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class Profiler
+  {
+  public:
+    static const size_t DefaultMaxEvents = 1 << 20;
+
+    struct NodeProfile
+    {
+      NodeHandle mHandle;
+      NodeTypeGUID mType;
+      uint64_t mCalls;
+      uint64_t mRootCalls;
+      double mInclusiveUs;
+      double mExclusiveUs;
+    };
+
+    // A type's inclusive time adds up its nodes', so a node running another of
+    // the same type counts that time twice.  Exclusive is exact.
+    struct TypeProfile
+    {
+      NodeTypeGUID mType;
+      uint64_t mCalls;
+      double mInclusiveUs;
+      double mExclusiveUs;
+    };
+
+    Profiler(RuntimeManager* runtime, size_t maxEventsPerThread = DefaultMaxEvents);
+
+    void Enter(NodeHandle handle, NodeTypeGUID type);
+    void Exit();
+
+    // Forgets everything recorded.  Nothing can be running through it.
+    void Clear();
+
+    // Merged across threads, sorted by exclusive time
+    void GetNodeProfiles(std::vector<NodeProfile>& profiles) const;
+    void GetTypeProfiles(std::vector<TypeProfile>& profiles) const;
+
+    // Trace Event Format, loads in chrome://tracing and Perfetto
+    void WriteChromeTrace(std::ostream& out) const;
+
+    // Per type, the maxNodes most expensive nodes and every root
+    void WriteSummary(std::ostream& out, size_t maxNodes = 20) const;
+
+  private:
+    struct Frame
+    {
+      NodeHandle mHandle;
+      NodeTypeGUID mType;
+      uint64_t mStart;
+      uint64_t mChildren;
+    };
+
+    // Dense on NodeHandle::mIndex, reset when the index gets reused
+    struct NodeTotals
+    {
+      NodeHandle mHandle;
+      NodeTypeGUID mType;
+      uint64_t mCalls;
+      uint64_t mRootCalls;
+      uint64_t mInclusive;
+      uint64_t mExclusive;
+    };
+
+    struct Event
+    {
+      NodeHandle mHandle;
+      NodeTypeGUID mType;
+      uint64_t mStart;
+      uint64_t mEnd;
+    };
+
+    struct ThreadState
+    {
+      std::thread::id mThread;
+      uint32_t mId;
+      std::vector<Frame> mStack;
+      std::vector<NodeTotals> mNodes;
+      std::vector<Event> mEvents;
+      uint64_t mDroppedEvents = 0;
+    };
+
+    static uint64_t Now();
+
+    ThreadState& GetThreadState();
+    double TicksPerUs() const;
+    std::string GetTypeName(NodeTypeGUID type) const;
+
+    RuntimeManager* mManager;
+    size_t mMaxEvents;
+    uint64_t mId; // Tells this profiler's thread states apart in the thread local cache
+
+    uint64_t mStartTicks;
+    uint64_t mStartNs;
+
+    mutable std::mutex mThreadsMutex;
+    std::vector<std::unique_ptr<ThreadState>> mThreads;
+  };
+}
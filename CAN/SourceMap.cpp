@@ -0,0 +1,276 @@
+﻿#include "SourceMap.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                   Source Map
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  std::string BaseName(const std::string& path)
+  {
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+  }
+
+  // Everything after the first space, for names that might have spaces in them
+  std::string Rest(const std::string& line)
+  {
+    size_t space = line.find(' ');
+    return space == std::string::npos ? std::string() : line.substr(space + 1);
+  }
+}
+
+uint32_t SourceMap::AddNode(RuntimeManager* runtime, NodeHandle handle)
+{
+  auto found = mIndices.find(handle);
+  if (found != mIndices.end())
+  {
+    return found->second;
+  }
+
+  NodeEntry entry = { handle, { 0, 0 }, NoUID, std::string() };
+
+  auto uid = mUIDs.find(handle);
+  if (uid != mUIDs.end())
+  {
+    entry.mUID = uid->second;
+  }
+
+  if (runtime && runtime->GetHandleTable().IsValid(handle))
+  {
+    entry.mBlock = runtime->GetHandleTable().GetBlock(handle);
+    entry.mType = runtime->GetNodeTypeName(runtime->GetWeakRef(handle)->GetTypeGUID());
+  }
+
+  uint32_t index = uint32_t(mNodes.size());
+  mNodes.push_back(entry);
+  mIndices.emplace(handle, index);
+
+  return index;
+}
+
+void SourceMap::AddLine(uint32_t line, uint32_t node)
+{
+  mLines.push_back({ line, node });
+}
+
+bool SourceMap::Find(const std::string& file, uint32_t line, uint32_t& node) const
+{
+  std::string name = BaseName(file);
+
+  if (!mLineFile.empty() && name == BaseName(mLineFile))
+  {
+    if (line == 0 || line > mNodes.size())
+    {
+      return false;
+    }
+
+    node = line - 1;
+    return true;
+  }
+
+  if (name != BaseName(mFile))
+  {
+    return false;
+  }
+
+  auto itr = std::lower_bound(mLines.begin(), mLines.end(), line, [](const LineEntry& entry, uint32_t l) { return entry.mLine < l; });
+  if (itr == mLines.end() || itr->mLine != line)
+  {
+    return false;
+  }
+
+  node = itr->mNode;
+  return true;
+}
+
+void SourceMap::Write(std::ostream& out) const
+{
+  out << "CANMAP 1\n";
+  out << "file " << mFile << "\n";
+
+  if (!mLineFile.empty())
+  {
+    out << "linefile " << mLineFile << "\n";
+  }
+
+  // node handle.index handle.generation allocator relative uid type
+  for (const NodeEntry& entry : mNodes)
+  {
+    out << "node " << entry.mHandle.mIndex << " " << entry.mHandle.mGeneration << " " << entry.mBlock.mAllocatorHandle << " " << entry.mBlock.mRelativeBlockHandle << " ";
+
+    if (entry.mUID == NoUID)
+    {
+      out << "-";
+    }
+    else
+    {
+      out << entry.mUID;
+    }
+
+    out << " " << (entry.mType.empty() ? "-" : entry.mType) << "\n";
+  }
+
+  for (const LineEntry& entry : mLines)
+  {
+    out << "line " << entry.mLine << " " << entry.mNode << "\n";
+  }
+}
+
+bool SourceMap::Read(std::istream& in, std::string& error)
+{
+  mFile.clear();
+  mLineFile.clear();
+  mNodes.clear();
+  mLines.clear();
+  mIndices.clear();
+
+  std::string line;
+  if (!std::getline(in, line) || line != "CANMAP 1")
+  {
+    error = "Source map: not a version 1 map";
+    return false;
+  }
+
+  uint32_t number = 1;
+  while (std::getline(in, line))
+  {
+    ++number;
+
+    if (!line.empty() && line.back() == '\r')
+    {
+      line.pop_back();
+    }
+
+    if (line.empty())
+    {
+      continue;
+    }
+
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+
+    if (kind == "file")
+    {
+      mFile = Rest(line);
+      continue;
+    }
+
+    if (kind == "linefile")
+    {
+      mLineFile = Rest(line);
+      continue;
+    }
+
+    if (kind == "node")
+    {
+      NodeEntry entry;
+      std::string uid;
+      if (fields >> entry.mHandle.mIndex >> entry.mHandle.mGeneration >> entry.mBlock.mAllocatorHandle >> entry.mBlock.mRelativeBlockHandle >> uid >> entry.mType)
+      {
+        entry.mUID = uid == "-" ? NoUID : uint32_t(std::strtoul(uid.c_str(), nullptr, 10));
+        entry.mType = entry.mType == "-" ? std::string() : entry.mType;
+
+        mIndices.emplace(entry.mHandle, uint32_t(mNodes.size()));
+        mNodes.push_back(entry);
+        continue;
+      }
+    }
+
+    if (kind == "line")
+    {
+      LineEntry entry;
+      if (fields >> entry.mLine >> entry.mNode && entry.mNode < mNodes.size())
+      {
+        mLines.push_back(entry);
+        continue;
+      }
+    }
+
+    error = "Source map: bad record on line " + std::to_string(number);
+    return false;
+  }
+
+  std::sort(mLines.begin(), mLines.end(), [](const LineEntry& a, const LineEntry& b) { return a.mLine < b.mLine; });
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 Profile Fold
+///////////////////////////////////////////////////////////////////////////////
+
+bool CAN::FoldPerfReport(const SourceMap& map, std::istream& report, FoldedProfile& profile, std::string& error)
+{
+  profile = FoldedProfile();
+
+  std::vector<double> percents(map.mNodes.size(), 0.0);
+  std::vector<uint64_t> samples(map.mNodes.size(), 0);
+  bool anyRows = false;
+
+  std::string line;
+  while (std::getline(report, line))
+  {
+    std::istringstream fields(line);
+
+    std::vector<std::string> tokens;
+    std::string token;
+    while (fields >> token)
+    {
+      tokens.push_back(token);
+    }
+
+    // Comments, headers and the blank lines between them
+    if (tokens.size() < 2 || tokens[0][0] == '#' || tokens[0].back() != '%')
+    {
+      continue;
+    }
+
+    double percent = std::strtod(tokens[0].c_str(), nullptr);
+
+    uint64_t count = 0;
+    if (tokens.size() >= 3)
+    {
+      count = std::strtoull(tokens[1].c_str(), nullptr, 10);
+    }
+
+    anyRows = true;
+
+    const std::string& location = tokens.back();
+    size_t colon = location.rfind(':');
+
+    uint32_t node;
+    if (colon == std::string::npos || !map.Find(location.substr(0, colon), uint32_t(std::strtoul(location.c_str() + colon + 1, nullptr, 10)), node))
+    {
+      profile.mUnmatchedPercent += percent;
+      profile.mUnmatchedSamples += count;
+      continue;
+    }
+
+    percents[node] += percent;
+    samples[node] += count;
+  }
+
+  if (!anyRows)
+  {
+    error = "Profile fold: no rows in the report, it needs perf report --sort srcline --stdio";
+    return false;
+  }
+
+  for (uint32_t node = 0; node < percents.size(); ++node)
+  {
+    if (percents[node] > 0.0 || samples[node] > 0)
+    {
+      profile.mNodes.push_back({ node, percents[node], samples[node] });
+    }
+  }
+
+  std::sort(profile.mNodes.begin(), profile.mNodes.end(), [](const FoldedNode& a, const FoldedNode& b) { return a.mPercent > b.mPercent; });
+  return true;
+}
@@ -0,0 +1,106 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                   Source Map
+  ///////////////////////////////////////////////////////////////////////////////
+  // Ties lines of C++ written by CodeEmitter back to the nodes they came from,
+  // so a profile of the compiled code can be read per node instead of per
+  // anonymous a+b.
+  //
+  // With a map set the emitter records the line of every IR instruction
+  // against the node it was lowered from, a value the optimizer folded or
+  // merged stays with the node that kept it.  Lines in mFile are recorded in
+  // mLines.  If mLineFile is set each of those lines also gets a #line
+  // directive naming line n + 1 of mLineFile for node n, so debug info and
+  // every profiler that reads it report nodes directly and the generated
+  // source isn't needed.
+  //
+  // Nodes keep their handle, the block they lived in and, if the caller put
+  // one in mUIDs before emitting, the editor's id.  Nodes Forestify or the
+  // optimizer made have no UID.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  class SourceMap
+  {
+  public:
+    static constexpr uint32_t NoUID = ~uint32_t(0);
+
+    struct NodeEntry
+    {
+      NodeHandle mHandle;
+      AllocatorFactory::AbsoluteBlockHandle mBlock;
+      uint32_t mUID;
+      std::string mType;
+    };
+
+    struct LineEntry
+    {
+      uint32_t mLine;
+      uint32_t mNode; // Into mNodes
+    };
+
+    std::string mFile;     // The generated source
+    std::string mLineFile; // Named by #line directives, empty for none
+
+    std::vector<NodeEntry> mNodes;
+    std::vector<LineEntry> mLines; // In line order
+
+    // Editor ids by handle, filled in by the caller before emitting
+    std::unordered_map<NodeHandle, uint32_t, NodeHandleHasher> mUIDs;
+
+    // Index of handle's entry, made the first time.  runtime can be null, the
+    // block and type are left empty then.
+    uint32_t AddNode(RuntimeManager* runtime, NodeHandle handle);
+    void AddLine(uint32_t line, uint32_t node);
+
+    // The node file:line belongs to.  Files match on their name without any
+    // directories since profilers print them however the compiler saw them.
+    bool Find(const std::string& file, uint32_t line, uint32_t& node) const;
+
+    // Text, one record per line.  Read replaces everything but mUIDs.
+    void Write(std::ostream& out) const;
+    bool Read(std::istream& in, std::string& error);
+
+  private:
+    std::unordered_map<NodeHandle, uint32_t, NodeHandleHasher> mIndices;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                                 Profile Fold
+  ///////////////////////////////////////////////////////////////////////////////
+  // Adds up a perf report per node.  Takes the --stdio output of
+  //
+  //   perf report --sort srcline [-n]
+  //
+  // where every row is an overhead, optionally a sample count, then file:line.
+  // Rows whose file:line isn't in the map go to the unmatched totals.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  struct FoldedNode
+  {
+    uint32_t mNode; // Into SourceMap::mNodes
+    double mPercent;
+    uint64_t mSamples;
+  };
+
+  struct FoldedProfile
+  {
+    std::vector<FoldedNode> mNodes; // Most expensive first
+    double mUnmatchedPercent = 0.0;
+    uint64_t mUnmatchedSamples = 0;
+  };
+
+  // Fails if nothing in report looks like a srcline row
+  bool FoldPerfReport(const SourceMap& map, std::istream& report, FoldedProfile& profile, std::string& error);
+}
@@ -0,0 +1,304 @@
+﻿#include "Tiered.h"
+#include "CodeEmitter.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                     Platform
+///////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+#ifdef _WIN32
+  const char* LibraryExtension = ".dll";
+
+  void MakeDirectory(const std::string& path) { _mkdir(path.c_str()); }
+  int ProcessId() { return _getpid(); }
+
+  void* OpenLibrary(const std::string& path) { return LoadLibraryA(path.c_str()); }
+  void* FindSymbol(void* library, const char* name) { return reinterpret_cast<void*>(GetProcAddress(static_cast<HMODULE>(library), name)); }
+  void CloseLibrary(void* library) { FreeLibrary(static_cast<HMODULE>(library)); }
+#else
+  const char* LibraryExtension = ".so";
+
+  void MakeDirectory(const std::string& path) { mkdir(path.c_str(), 0755); }
+  int ProcessId() { return getpid(); }
+
+  void* OpenLibrary(const std::string& path) { return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL); }
+  void* FindSymbol(void* library, const char* name) { return dlsym(library, name); }
+  void CloseLibrary(void* library) { dlclose(library); }
+#endif
+
+  uint64_t Fnv1a(uint64_t hash, const std::string& data)
+  {
+    for (char c : data)
+    {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 1099511628211ull;
+    }
+
+    return hash;
+  }
+
+  bool WriteFile(const std::string& path, const std::string& data)
+  {
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+    {
+      return false;
+    }
+
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    return std::fclose(file) == 0 && written;
+  }
+
+  void ReplaceAll(std::string& text, const std::string& from, const std::string& to)
+  {
+    for (size_t at = text.find(from); at != std::string::npos; at = text.find(from, at + to.size()))
+    {
+      text.replace(at, from.size(), to);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                              Native Compiler
+///////////////////////////////////////////////////////////////////////////////
+
+NativeCompiler::NativeCompiler(const TieringOptions& options) : mOptions(options)
+{
+  mThread = std::thread([this]() { Run(); });
+}
+
+NativeCompiler::~NativeCompiler()
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+
+  mWake.notify_one();
+  mThread.join();
+
+  for (void* library : mLibraries)
+  {
+    CloseLibrary(library);
+  }
+}
+
+const TieringOptions& NativeCompiler::GetOptions() const { return mOptions; }
+
+void NativeCompiler::Submit(std::string header, std::string source, Callback done)
+{
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQueue.push_back({ std::move(header), std::move(source), std::move(done) });
+  }
+
+  mWake.notify_one();
+}
+
+void NativeCompiler::Run()
+{
+  for (;;)
+  {
+    Request request;
+
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mWake.wait(lock, [this]() { return mStopping || !mQueue.empty(); });
+
+      if (mStopping)
+      {
+        return;
+      }
+
+      request = std::move(mQueue.front());
+      mQueue.pop_front();
+    }
+
+    request.mDone(Build(request));
+  }
+}
+
+NativeEntry NativeCompiler::Build(const Request& request)
+{
+  uint64_t hash = 14695981039346656037ull;
+  hash = Fnv1a(hash, mOptions.mCompileCommand);
+  hash = Fnv1a(hash, request.mHeader);
+  hash = Fnv1a(hash, request.mSource);
+
+  char name[17];
+  std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+
+  std::string directory = mOptions.mCacheDirectory + "/" + name;
+  std::string library = directory + "/Forest" + LibraryExtension;
+
+  MakeDirectory(mOptions.mCacheDirectory);
+  MakeDirectory(directory);
+
+  void* handle = OpenLibrary(library);
+
+  if (!handle)
+  {
+    std::string source = directory + "/Forest.cpp";
+
+    if (!WriteFile(directory + "/Forest.h", request.mHeader) || !WriteFile(source, request.mSource))
+    {
+      return nullptr;
+    }
+
+    // Built under a name of its own and renamed into place, so another process
+    // never loads a half written library
+    std::string temporary = directory + "/Forest." + std::to_string(ProcessId()) + LibraryExtension;
+
+    std::string command = mOptions.mCompileCommand;
+    ReplaceAll(command, "{source}", "\"" + source + "\"");
+    ReplaceAll(command, "{output}", "\"" + temporary + "\"");
+    command += " > \"" + directory + "/build.log\" 2>&1";
+
+    if (std::system(command.c_str()) != 0)
+    {
+      std::remove(temporary.c_str());
+      return nullptr;
+    }
+
+    // Losing the race to another process is fine, its library is the same
+    if (std::rename(temporary.c_str(), library.c_str()) != 0)
+    {
+      std::remove(temporary.c_str());
+    }
+
+    handle = OpenLibrary(library);
+    if (!handle)
+    {
+      return nullptr;
+    }
+  }
+
+  mLibraries.push_back(handle);
+  return reinterpret_cast<NativeEntry>(FindSymbol(handle, "Forest_Run"));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                Tiered Forest
+///////////////////////////////////////////////////////////////////////////////
+
+TieredForest::TieredForest(NodeForest& forest, NativeCompiler& compiler) :
+  mForest(forest),
+  mCompiler(compiler),
+  mEntry(std::make_shared<std::atomic<NativeEntry>>(nullptr))
+{
+  RuntimeManager* runtime = forest.GetRuntime();
+
+  std::vector<NodeHandle> order = forest.mTopologicalOrder;
+  if (order.empty())
+  {
+    TopologicalOrder(runtime, forest.mRoots, order);
+  }
+
+  // Negative indices never get submitted, lowering turns them down
+  for (NodeHandle handle : order)
+  {
+    Node* node = runtime->GetWeakRef(handle);
+
+    if (node->GetTypeGUID() == IntegerInputNode::TypeGUID)
+    {
+      IntegerInputNode* input = static_cast<IntegerInputNode*>(node);
+      if (input->mIndex >= 0)
+      {
+        mInputs.push_back(input);
+        mInputCount = std::max(mInputCount, uint32_t(input->mIndex) + 1);
+      }
+    }
+    else if (node->GetTypeGUID() == IntegerOutputNode::TypeGUID)
+    {
+      IntegerOutputNode* output = static_cast<IntegerOutputNode*>(node);
+      if (output->mIndex >= 0)
+      {
+        mOutputs.push_back(output);
+        mOutputCount = std::max(mOutputCount, uint32_t(output->mIndex) + 1);
+      }
+    }
+  }
+}
+
+void TieredForest::Execute(int* io)
+{
+  ++mExecutions;
+
+  NativeEntry entry = mEntry->load(std::memory_order_acquire);
+  if (entry)
+  {
+    entry(io);
+    return;
+  }
+
+  for (IntegerInputNode* input : mInputs)
+  {
+    input->mValue = io[input->mIndex];
+  }
+
+  mForest.Execute();
+
+  for (IntegerOutputNode* output : mOutputs)
+  {
+    io[mInputCount + output->mIndex] = output->mValue;
+  }
+
+  if (!mSubmitted && mExecutions >= mCompiler.GetOptions().mThreshold)
+  {
+    SubmitForCompile();
+  }
+}
+
+bool TieredForest::IsNative() const
+{
+  return mEntry->load(std::memory_order_acquire) != nullptr;
+}
+
+uint64_t TieredForest::GetExecutionCount() const { return mExecutions; }
+uint32_t TieredForest::GetInputCount() const { return mInputCount; }
+uint32_t TieredForest::GetOutputCount() const { return mOutputCount; }
+
+void TieredForest::SubmitForCompile()
+{
+  mSubmitted = true;
+
+  // Generated here rather than on the compiler's thread, which would be
+  // reading the forest while Execute runs it
+  std::ostringstream header;
+  std::ostringstream source;
+  std::string error;
+
+  if (!WriteTranslationUnit(mForest, "Forest", header, source, error))
+  {
+    return;
+  }
+
+  std::shared_ptr<std::atomic<NativeEntry>> entry = mEntry;
+  mCompiler.Submit(header.str(), source.str(), [entry](NativeEntry native)
+  {
+    if (native)
+    {
+      entry->store(native, std::memory_order_release);
+    }
+  });
+}
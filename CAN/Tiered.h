@@ -0,0 +1,129 @@
+﻿#pragma once
+
+#include "CAN.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace CAN
+{
+  ///////////////////////////////////////////////////////////////////////////////
+  //                                                            Tiered Execution
+  ///////////////////////////////////////////////////////////////////////////////
+  // Forests start out interpreted and move to native code once they're hot.
+  // After mThreshold executions the forest is lowered, run through OptimizeIR
+  // and written out as a translation unit (see WriteTranslationUnit), handed
+  // to the NativeCompiler's background thread, built into a shared library
+  // with the locally installed compiler and loaded.  The next Execute after
+  // that goes straight to the native entry.
+  //
+  // Libraries are cached on disk by a hash of the generated code and the
+  // compile command, mCacheDirectory/<hash>/ holds the source, the library and
+  // the compiler's output.  A forest that's been seen before, in this process
+  // or an earlier one, only pays for loading the library.
+  //
+  // If anything goes wrong the forest just stays interpreted, look at
+  // build.log in its cache directory.  Needs -ldl on Linux.
+  ///////////////////////////////////////////////////////////////////////////////
+
+  // Name_Run from the translation unit, io is the IO struct as ints
+  using NativeEntry = void(*)(int* io);
+
+  struct TieringOptions
+  {
+    uint32_t mThreshold = 1000;
+
+    // Created if missing, its parent has to exist
+    std::string mCacheDirectory = "can_cache";
+
+    // {source} and {output} are replaced with the paths to build
+#ifdef _WIN32
+    std::string mCompileCommand = "cl /nologo /O2 /LD {source} /Fe{output} /link /EXPORT:Forest_Run";
+#else
+    std::string mCompileCommand = "c++ -O2 -shared -fPIC -o {output} {source}";
+#endif
+  };
+
+  // One background thread building for every TieredForest that uses it.
+  // Loaded libraries stay loaded until the compiler is destroyed, so it has to
+  // outlive its forests.
+  class NativeCompiler
+  {
+  public:
+    using Callback = std::function<void(NativeEntry)>;
+
+    NativeCompiler(const TieringOptions& options = TieringOptions());
+    ~NativeCompiler();
+
+    const TieringOptions& GetOptions() const;
+
+    // done is called on the background thread with the loaded entry, or
+    // nullptr if the build failed.  Requests still queued when the compiler is
+    // destroyed are dropped without calling done.
+    void Submit(std::string header, std::string source, Callback done);
+
+  private:
+    struct Request
+    {
+      std::string mHeader;
+      std::string mSource;
+      Callback mDone;
+    };
+
+    void Run();
+    NativeEntry Build(const Request& request);
+
+    TieringOptions mOptions;
+
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::deque<Request> mQueue;
+    bool mStopping = false;
+
+    std::vector<void*> mLibraries; // Only touched by mThread
+    std::thread mThread;
+  };
+
+  class TieredForest
+  {
+  public:
+    TieredForest(NodeForest& forest, NativeCompiler& compiler);
+
+    // io holds every input then every output, the same layout as the forest's
+    // IO struct.  Inputs are copied onto the Input nodes before interpreting,
+    // Output nodes are copied back after.  Not reentrant, same as
+    // NodeForest::Execute.
+    void Execute(int* io);
+
+    bool IsNative() const;
+    uint64_t GetExecutionCount() const;
+
+    uint32_t GetInputCount() const;
+    uint32_t GetOutputCount() const;
+
+  private:
+    void SubmitForCompile();
+
+    NodeForest& mForest;
+    NativeCompiler& mCompiler;
+
+    std::vector<IntegerInputNode*> mInputs;
+    std::vector<IntegerOutputNode*> mOutputs;
+    uint32_t mInputCount = 0;
+    uint32_t mOutputCount = 0;
+
+    uint64_t mExecutions = 0;
+    bool mSubmitted = false;
+
+    // Shared with the compile callback so the forest can go away mid build
+    std::shared_ptr<std::atomic<NativeEntry>> mEntry;
+  };
+}
@@ -0,0 +1,82 @@
+#include "CAN.h"
+#include "SourceMap.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+using namespace CAN;
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                 Fold Profile
+///////////////////////////////////////////////////////////////////////////////
+// Folds a perf report of code written by WriteTranslationUnit back onto the
+// graph's nodes, using the source map written with it.
+//
+//   perf record ./host
+//   perf report --sort srcline -n --stdio > report.txt
+//   FoldProfile Graph.canmap [report.txt]
+//
+// Reads the report from stdin without a second argument.  Prints one row per
+// node that got samples, most expensive first, then whatever didn't land in
+// the generated code.
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    std::fprintf(stderr, "usage: FoldProfile map.canmap [report.txt]\n");
+    return 1;
+  }
+
+  std::ifstream mapFile(argv[1]);
+  if (!mapFile)
+  {
+    std::fprintf(stderr, "Couldn't open %s\n", argv[1]);
+    return 1;
+  }
+
+  SourceMap map;
+  std::string error;
+  if (!map.Read(mapFile, error))
+  {
+    std::fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  std::ifstream reportFile;
+  if (argc > 2)
+  {
+    reportFile.open(argv[2]);
+    if (!reportFile)
+    {
+      std::fprintf(stderr, "Couldn't open %s\n", argv[2]);
+      return 1;
+    }
+  }
+
+  FoldedProfile profile;
+  if (!FoldPerfReport(map, argc > 2 ? reportFile : std::cin, profile, error))
+  {
+    std::fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  std::printf("%9s %10s %10s %12s %20s  %s\n", "overhead", "samples", "uid", "handle", "block", "type");
+
+  for (const FoldedNode& folded : profile.mNodes)
+  {
+    const SourceMap::NodeEntry& node = map.mNodes[folded.mNode];
+
+    std::string uid = node.mUID == SourceMap::NoUID ? "-" : std::to_string(node.mUID);
+    std::string handle = std::to_string(node.mHandle.mIndex) + ":" + std::to_string(node.mHandle.mGeneration);
+    std::string block = std::to_string(node.mBlock.mAllocatorHandle) + ":" + std::to_string(node.mBlock.mRelativeBlockHandle);
+
+    std::printf("%8.2f%% %10llu %10s %12s %20s  %s\n", folded.mPercent, (unsigned long long)folded.mSamples, uid.c_str(), handle.c_str(), block.c_str(), node.mType.empty() ? "-" : node.mType.c_str());
+  }
+
+  std::printf("%8.2f%% %10llu  outside the generated code\n", profile.mUnmatchedPercent, (unsigned long long)profile.mUnmatchedSamples);
+  return 0;
+}
@@ -868,7 +868,12 @@ void MakeNode(ImDrawList* draw_list, std::shared_ptr<Node> node)
   }
 }
 
+#include "GraphFile.h"
+
 std::string Serialize();
+std::vector<char> SerializeBinary();
+
+const char* gGraphFilePath = "graph.canb";
 
 bool gOpenAddNodeDialog = false;
 bool gSerializeDebugPopup = false;
@@ -880,6 +885,7 @@ std::string gToCPPString;
 std::unordered_map<std::string, std::shared_ptr<NodeType>> gNodeTypes;
 
 std::string ToCPP();
+bool ExportCPP(const char* name);
 
 void DrawNodeGraph(ImGuiIO& io)
 {
@@ -904,12 +910,26 @@ void DrawNodeGraph(ImGuiIO& io)
       gSerializeDebugPopupString = Serialize();
     }
 
+    ImGui::SameLine();
+
+    if(ImGui::Button("Save"))
+    {
+      CAN::WriteGraphFile(gGraphFilePath, SerializeBinary());
+    }
+
     if(ImGui::Button("To CPP"))
     {
       gToCPPDebugPopup = true;
       gToCPPString = ToCPP();
     }
 
+    ImGui::SameLine();
+
+    if(ImGui::Button("Export CPP"))
+    {
+      ExportCPP("Graph");
+    }
+
     ImGui::SameLine(ImGui::GetWindowWidth() - 100);
     ImGui::Checkbox("Show grid", &show_grid);
     ImGui::BeginChild("scrolling_region", ImVec2(0, 0), true, ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoMove);
@@ -1284,6 +1304,87 @@ void Deserialize(std::string data)
   }
 }
 
+std::vector<char> SerializeBinary()
+{
+  CAN::GraphFileBuilder builder;
+
+  for(auto pnode : gNodes)
+  {
+    ImVec2 pos = pnode->GetCenterPosition();
+    std::string typeName = pnode->GetType()->GetTypeName();
+    builder.AddNode(typeName.c_str(), typeName.size(), pnode->GetNodeUID(), pos.x, pos.y, pnode->GetUserData());
+
+    for(auto slot : pnode->GetInputSlots())
+    {
+      auto connections = slot->GetConnections();
+
+      for (std::shared_ptr<SlotConnection>& sc : connections)
+      {
+        builder.AddEdge(slot->GetNodeIndex(), sc->mOutput->GetOwner()->GetNodeUID(), sc->mOutput->GetNodeIndex(), sc->mControlPoint.x, sc->mControlPoint.y);
+      }
+    }
+  }
+
+  std::vector<char> data;
+  std::string error;
+  builder.Write(data, error);
+
+  return data;
+}
+
+// Walks the records straight out of the mapping, user data is stored raw so
+// there's nothing to parse
+void DeserializeBinary(const CAN::GraphFileView& view)
+{
+  const CAN::GraphFile::NodeRecord* records = view.GetNodes();
+  std::vector<std::shared_ptr<Node>> nodes(view.GetNodeCount());
+
+  // Type names are interned in the file, so one lookup per type
+  std::unordered_map<uint32_t, std::shared_ptr<NodeType>> typesByName;
+
+  for (uint32_t i = 0; i < view.GetNodeCount(); ++i)
+  {
+    const CAN::GraphFile::NodeRecord& record = records[i];
+
+    auto iType = typesByName.find(record.mTypeName);
+    if (iType == typesByName.end())
+    {
+      auto registered = gNodeTypes.find(view.GetString(record.mTypeName));
+      iType = typesByName.emplace(record.mTypeName, registered == gNodeTypes.end() ? nullptr : registered->second).first;
+    }
+
+    if (!iType->second)
+    {
+      // Couldn't find type in registered types
+      continue;
+    }
+
+    nodes[i] = iType->second->MakeNode(ImVec2(record.mX, record.mY), record.mUID, record.mUserData);
+    gNodes.push_back(nodes[i]);
+    gUIDToNode[record.mUID] = nodes[i];
+  }
+
+  const CAN::GraphFile::EdgeRecord* edges = view.GetEdges();
+
+  for (uint32_t i = 0; i < view.GetEdgeCount(); ++i)
+  {
+    const CAN::GraphFile::EdgeRecord& edge = edges[i];
+
+    std::shared_ptr<Node> inputNode = nodes[edge.mInputNode];
+    std::shared_ptr<Node> outputNode = nodes[edge.mOutputNode];
+
+    if (!inputNode || !outputNode || edge.mInputSlot >= inputNode->GetInputSlots().size() || edge.mOutputSlot >= outputNode->GetOutputSlots().size())
+    {
+      continue;
+    }
+
+    std::shared_ptr<Slot> inputSlot = inputNode->GetInputSlots()[edge.mInputSlot];
+    std::shared_ptr<Slot> outputSlot = outputNode->GetOutputSlots()[edge.mOutputSlot];
+
+    inputSlot->Connect(outputSlot, ImVec2(edge.mControlX, edge.mControlY));
+  }
+}
+
 void MakeGraph()
 {
   std::shared_ptr<SlotType> Integer = std::make_shared<SlotType>("Integer", gDefaultSlotFillColor, gDefaultSlotEdgeColor, gDefaultSlotRoundedness, gDefaultHoveredSlotFillColor, gDefaultHoveredSlotEdgeColor, gDefaultHoveredSlotRoundedness);
@@ -1312,6 +1413,14 @@ void RegisterNodeTypes();
 void DeserializeGraph()
 {
   RegisterNodeTypes();
+
+  CAN::MappedGraphFile file;
+  if (file.Open(gGraphFilePath))
+  {
+    DeserializeBinary(file.GetView());
+    return;
+  }
+
   Deserialize("Add:41:805.000000,298.000000::0,18467,0,621.500000,217.750000\n"
               "IntegerLiteral:18467:394.000000,289.000000:6:"
 
@@ -1319,46 +1428,17 @@ void DeserializeGraph()
 }
 
 #include "CAN.h"
+#include "CodeEmitter.h"
+#include "Optimize.h"
+#include "PoolAllocator.h"
+#include "SourceMap.h"
 
-class DumbAllocator final : public CAN::Allocator
-{
-public:
-  DumbAllocator(int size) : mSize(size) {}
-
-  CAN::AllocatorFactory::RelativeBlockHandle Allocate() override
-  {
-    char* d = new char[mSize];
-    return reinterpret_cast<uint64_t>(d);
-  }
-
-  void Free(CAN::AllocatorFactory::RelativeBlockHandle handle) override { delete[] reinterpret_cast<char*>(handle); }
-
-  void* GetWeakRef(CAN::AllocatorFactory::RelativeBlockHandle handle) override
-  {
-    char* d = reinterpret_cast<char*>(handle);
-    return d;
-  }
-
-  CAN::AllocatorFactory::AllocatorHandle GetAllocatorHandle() override { return reinterpret_cast<uint64_t>(this); }
-
-private:
-  int mSize;
-};
-
-class DumbAllocatorFactory : public CAN::AllocatorFactory
-{
-public:
-  AllocatorHandle MakeAllocator(size_t size, CAN::NodeTypeGUID uid) override { return reinterpret_cast<uint64_t>(new DumbAllocator(size)); }
-  void FreeAllocator(CAN::Allocator* alloc) override { return delete reinterpret_cast<DumbAllocator*>(alloc); }
-
-  CAN::Allocator* LookupAllocator(AllocatorHandle handle) { return reinterpret_cast<CAN::Allocator*>(handle); }
-};
-
+#include <fstream>
 #include <functional>
 
 std::unordered_map<std::shared_ptr<NodeType>, CAN::NodeTypeGUID> gNodeTypeLookup;
 CAN::RuntimeManager gCANRuntime;
-DumbAllocatorFactory gCANAllocatorFactory;
+CAN::PoolAllocatorFactory gCANAllocatorFactory;
 
 void RegisterNodeTypes()
 {
@@ -1380,6 +1460,8 @@ void RegisterNodeTypes()
     switch(nodeGUID)
     {
     case CAN::IntegerLiteralNode::TypeGUID:
+    case CAN::IntegerInputNode::TypeGUID:  // User data is the input index
+    case CAN::IntegerOutputNode::TypeGUID: // User data is the output index
       {
         newNodeType = std::make_shared<IntegerLiteralNodeType>(name, gDefaultNodeFillColor, gDefaultNodeEdgeColor, gDefaultNodeRoundedness);
       }
@@ -1430,11 +1512,15 @@ void RegisterNodeTypes()
   gNodeTypes["PrintInteger"] = PrintInteger;*/
 }
 
-std::string ToCPP()
+// uids, if given, gets the editor UID of every CAN node made
+CAN::NodeForest BuildForest(std::unordered_map<CAN::NodeHandle, uint32_t, CAN::NodeHandleHasher>* uids = nullptr)
 {
   std::stack<std::pair<std::shared_ptr<Slot>, int>> toConnect;
-  std::unordered_map<std::shared_ptr<Node>, CAN::AllocatorFactory::AbsoluteBlockHandle> nodeLookup;
-  std::vector<CAN::AllocatorFactory::AbsoluteBlockHandle> nodeCluster;
+  std::unordered_map<std::shared_ptr<Node>, CAN::NodeHandle> nodeLookup;
+  std::vector<CAN::NodeHandle> nodeCluster;
+
+  // Everything below lives in here and goes away with the forest
+  auto arena = std::make_shared<CAN::NodeArena>(&gCANRuntime);
 
   for(auto& n : gNodes)
   {
@@ -1443,12 +1529,17 @@ std::string ToCPP()
     void** populatedata_ptr = populatedata;
 
     n->GetType()->UserDataToPopulateData(n->GetUserData(), populatedata_ptr);
-    auto block = gCANRuntime.AllocateNode(gNodeTypeLookup[n->GetType()], populatedata_ptr);
+    auto block = arena->AllocateNode(gNodeTypeLookup[n->GetType()], populatedata_ptr);
 
     // Register Node Lookup
     nodeLookup[n] = block;
     nodeCluster.push_back(block);
 
+    if (uids)
+    {
+      (*uids)[block] = n->GetNodeUID();
+    }
+
     for(int i = 0; i < n->GetInputSlots().size(); ++i)
     {
       // Register To Connect
@@ -1467,18 +1558,53 @@ std::string ToCPP()
     auto canOutput = nodeLookup[editorOutput];
     auto canInput = nodeLookup[editorInput];
 
-    CAN::Node* rawCanOutput = static_cast<CAN::Node*>(gCANRuntime.GetAllocatorFactory()->GetWeakRef(canOutput));
-    CAN::Node* rawCanInput = static_cast<CAN::Node*>(gCANRuntime.GetAllocatorFactory()->GetWeakRef(canInput));
+    CAN::Node* rawCanOutput = gCANRuntime.GetWeakRef(canOutput);
+    CAN::Node* rawCanInput = gCANRuntime.GetWeakRef(canInput);
 
-    rawCanInput->GetInputs()[inputIndex]->Connect(rawCanOutput->GetOutputs()[slot->GetConnections()[0]->mOutput->GetNodeIndex()]);
+    rawCanInput->GetInputSlots()[inputIndex]->Connect(rawCanOutput->GetOutputSlots()[slot->GetConnections()[0]->mOutput->GetNodeIndex()]);
 
     toConnect.pop();
   }
 
-  CAN::NodeForest forest = CAN::Forestify(CAN::NodeClusterToNodeGraph(&gCANRuntime, nodeCluster));
+  CAN::NodeGraph graph = CAN::NodeClusterToNodeGraph(arena, nodeCluster);
+  CAN::EliminateCommonSubexpressions(graph);
+
+  CAN::NodeForest forest = CAN::Forestify(graph);
+  CAN::OptimizeForest(forest, &nodeCluster);
+
+  return forest;
+}
+
+std::string ToCPP()
+{
+  CAN::NodeForest forest = BuildForest();
   return forest.ToCPP();
 }
 
+// Writes name.h and name.cpp next to the executable, and name.canmap so
+// profiles of the compiled code can be folded back onto editor nodes
+bool ExportCPP(const char* name)
+{
+  CAN::SourceMap map;
+  CAN::NodeForest forest = BuildForest(&map.mUIDs);
+
+  std::ofstream header(std::string(name) + ".h");
+  std::ofstream source(std::string(name) + ".cpp");
+
+  std::string error;
+  if (!CAN::WriteTranslationUnit(forest, name, header, source, error, &map))
+  {
+    gToCPPDebugPopup = true;
+    gToCPPString = error;
+    return false;
+  }
+
+  std::ofstream mapFile(std::string(name) + ".canmap");
+  map.Write(mapFile);
+
+  return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Todo:
 //   Fix Node Hetero/Homogeneous nonsense